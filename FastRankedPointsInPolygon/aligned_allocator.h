@@ -0,0 +1,69 @@
+#ifndef ALIGNED_ALLOCATOR_H
+#define ALIGNED_ALLOCATOR_H
+
+#include <cstddef>
+#include <malloc.h>
+#include <new>
+#include <vector>
+
+/// <summary>
+/// A std::allocator replacement handing out storage aligned to
+/// <typeparamref name="Alignment"/> bytes, used for cache line sized nodes
+/// and for arrays read with aligned SIMD loads.
+/// </summary>
+template <typename T, std::size_t Alignment = 64>
+struct aligned_allocator
+{
+  typedef T value_type;
+
+  template <typename U>
+  struct rebind
+  {
+    typedef aligned_allocator<U, Alignment> other;
+  };
+
+  aligned_allocator() noexcept
+  {
+  }
+
+  template <typename U>
+  aligned_allocator(const aligned_allocator<U, Alignment>&) noexcept
+  {
+  }
+
+  T* allocate(std::size_t n)
+  {
+    void* ret = _aligned_malloc(n * sizeof(T), Alignment);
+    if (ret == nullptr) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(ret);
+  }
+
+  void deallocate(T* p, std::size_t) noexcept
+  {
+    _aligned_free(p);
+  }
+};
+
+template <typename T, typename U, std::size_t Alignment>
+inline bool operator==(const aligned_allocator<T, Alignment>&,
+  const aligned_allocator<U, Alignment>&) noexcept
+{
+  return true;
+}
+
+template <typename T, typename U, std::size_t Alignment>
+inline bool operator!=(const aligned_allocator<T, Alignment>&,
+  const aligned_allocator<U, Alignment>&) noexcept
+{
+  return false;
+}
+
+/// <summary>
+/// A std::vector whose storage starts on a 64 byte boundary.
+/// </summary>
+template <typename T>
+using aligned_vector = std::vector<T, aligned_allocator<T, 64>>;
+
+#endif
@@ -0,0 +1,92 @@
+#include "arena.h"
+
+#include <cstdint>
+#include <malloc.h>
+#include <new>
+
+namespace
+{
+  constexpr std::size_t BLOCK_ALIGNMENT = 64ull;
+}
+
+__stdcall arena::arena(std::size_t block_size) :
+  block_size_(block_size),
+  cursor_(nullptr),
+  end_(nullptr),
+  capacity_bytes_(0u),
+  thread_safe_(true)
+{
+}
+
+__stdcall arena::~arena()
+{
+  release();
+}
+
+void* __stdcall arena::allocate(std::size_t bytes, std::size_t alignment)
+{
+  if (bytes == 0u) {
+    bytes = 1u;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+  if (thread_safe_) {
+    lock.lock();
+  }
+  if (bytes > block_size_ / 4u) {
+    // Large requests would waste most of a shared block, give them their
+    // own and keep bumping the current one.
+    return allocate_block(bytes);
+  }
+
+  const uintptr_t cursor = reinterpret_cast<uintptr_t>(cursor_);
+  const uintptr_t aligned = (cursor + alignment - 1u) & ~(alignment - 1u);
+  if (cursor_ == nullptr ||
+    aligned + bytes > reinterpret_cast<uintptr_t>(end_)) {
+    cursor_ = allocate_block(block_size_);
+    end_ = cursor_ + block_size_;
+    cursor_ += bytes;
+    return cursor_ - bytes;
+  }
+  cursor_ = reinterpret_cast<char*>(aligned + bytes);
+  return reinterpret_cast<char*>(aligned);
+}
+
+void __stdcall arena::set_thread_safe(bool thread_safe)
+{
+  thread_safe_ = thread_safe;
+}
+
+void __stdcall arena::release()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (char* block : blocks_) {
+    _aligned_free(block);
+  }
+  blocks_.clear();
+  blocks_.shrink_to_fit();
+  cursor_ = nullptr;
+  end_ = nullptr;
+  capacity_bytes_ = 0u;
+}
+
+std::size_t __stdcall arena::capacity_bytes() const
+{
+  return capacity_bytes_;
+}
+
+char* __stdcall arena::allocate_block(std::size_t size)
+{
+  char* ret = static_cast<char*>(_aligned_malloc(size, BLOCK_ALIGNMENT));
+  if (ret == nullptr) {
+    throw std::bad_alloc();
+  }
+  try {
+    blocks_.push_back(ret);
+  } catch (...) {
+    _aligned_free(ret);
+    throw;
+  }
+  capacity_bytes_ += size;
+  return ret;
+}
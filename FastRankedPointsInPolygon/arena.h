@@ -0,0 +1,127 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/// <summary>
+/// A bump allocator handing out memory from large 64 byte aligned blocks.
+/// Nothing is freed on its own, <see cref="arena::release"/> or the
+/// destructor frees every block at once, so objects placed in an arena must
+/// not need their destructors run. Allocation is thread safe unless turned
+/// off with <see cref="arena::set_thread_safe"/>.
+/// </summary>
+class __declspec(dllexport) arena
+{
+public:
+  constexpr static std::size_t BLOCK_SIZE = 1ull << 18;
+
+  /// <summary>
+  /// Constructor for an empty arena. No memory is reserved until the first
+  /// allocation.
+  /// </summary>
+  /// <param name="block_size">
+  /// The size of every block. Requests larger than a quarter of it get a
+  /// block of their own.
+  /// </param>
+  explicit __stdcall arena(std::size_t block_size = BLOCK_SIZE);
+
+  __stdcall ~arena();
+
+  arena(const arena&) = delete;
+
+  arena& operator=(const arena&) = delete;
+
+  /// <summary>
+  /// Reserves <paramref name="bytes"/> bytes aligned to
+  /// <paramref name="alignment"/>, which must be a power of two no larger
+  /// than 64.
+  /// </summary>
+  /// <returns>The reserved memory, never nullptr.</returns>
+  void* __stdcall allocate(std::size_t bytes, std::size_t alignment);
+
+  /// <summary>
+  /// Whether <see cref="arena::allocate"/> takes a lock. An arena only
+  /// filled by one thread can skip it.
+  /// </summary>
+  void __stdcall set_thread_safe(bool thread_safe);
+
+  /// <summary>
+  /// Frees every block. All memory handed out becomes invalid.
+  /// </summary>
+  void __stdcall release();
+
+  /// <summary>
+  /// The number of bytes held in blocks.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall capacity_bytes() const;
+
+private:
+  char* __stdcall allocate_block(std::size_t size);
+
+private:
+  std::size_t block_size_;
+  std::vector<char*> blocks_;
+  char* cursor_;
+  char* end_;
+  std::size_t capacity_bytes_;
+  bool thread_safe_;
+  std::mutex mutex_;
+};
+
+/// <summary>
+/// A std::allocator replacement drawing from an <see cref="arena"/>.
+/// deallocate does nothing, the memory is returned when the arena is
+/// released.
+/// </summary>
+template <typename T>
+struct arena_allocator
+{
+  typedef T value_type;
+
+  template <typename U>
+  struct rebind
+  {
+    typedef arena_allocator<U> other;
+  };
+
+  explicit arena_allocator(arena& owner) noexcept :
+    arena_(&owner)
+  {
+  }
+
+  template <typename U>
+  arena_allocator(const arena_allocator<U>& other) noexcept :
+    arena_(other.arena_)
+  {
+  }
+
+  T* allocate(std::size_t n)
+  {
+    return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T*, std::size_t) noexcept
+  {
+  }
+
+  arena* arena_;
+};
+
+template <typename T, typename U>
+inline bool operator==(const arena_allocator<T>& lhs,
+  const arena_allocator<U>& rhs) noexcept
+{
+  return lhs.arena_ == rhs.arena_;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const arena_allocator<T>& lhs,
+  const arena_allocator<U>& rhs) noexcept
+{
+  return lhs.arena_ != rhs.arena_;
+}
+
+#endif
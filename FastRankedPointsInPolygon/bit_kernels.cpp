@@ -0,0 +1,155 @@
+#include "bit_kernels.h"
+
+#include "cpu_features.h"
+
+#include <intrin.h>
+
+namespace
+{
+  typedef int32_t(*Msb64_t)(uint64_t);
+  typedef uint64_t(*Spread32_t)(uint32_t);
+  typedef uint32_t(*Compact64_t)(uint64_t);
+
+  int32_t msb64_portable(uint64_t x)
+  {
+    if (x == 0ull) {
+      return -1;
+    }
+    int32_t ret = 0;
+    for (uint32_t shift = 32u; shift != 0u; shift /= 2u) {
+      if (x >> shift) {
+        x >>= shift;
+        ret += static_cast<int32_t>(shift);
+      }
+    }
+    return ret;
+  }
+
+  int32_t msb64_bsr(uint64_t x)
+  {
+    unsigned long index = 0ul;
+    return _BitScanReverse64(&index, x) ? static_cast<int32_t>(index) : -1;
+  }
+
+  int32_t msb64_lzcnt(uint64_t x)
+  {
+    // lzcnt of 0 is 64, which maps to -1.
+    return 63 - static_cast<int32_t>(__lzcnt64(x));
+  }
+
+  uint64_t spread32_portable(uint32_t v)
+  {
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000ffff0000ffffull;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ffull;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0full;
+    x = (x | (x << 2)) & 0x3333333333333333ull;
+    x = (x | (x << 1)) & 0x5555555555555555ull;
+    return x;
+  }
+
+  uint64_t spread32_bmi2(uint32_t x)
+  {
+    return _pdep_u64(x, 0x5555555555555555ull);
+  }
+
+  uint32_t compact64_portable(uint64_t x)
+  {
+    x &= 0x5555555555555555ull;
+    x = (x | (x >> 1)) & 0x3333333333333333ull;
+    x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0full;
+    x = (x | (x >> 4)) & 0x00ff00ff00ff00ffull;
+    x = (x | (x >> 8)) & 0x0000ffff0000ffffull;
+    x = (x | (x >> 16)) & 0x00000000ffffffffull;
+    return static_cast<uint32_t>(x);
+  }
+
+  uint32_t compact64_bmi2(uint64_t x)
+  {
+    return static_cast<uint32_t>(_pext_u64(x, 0x5555555555555555ull));
+  }
+
+  MsbKernel clamp_msb_kernel(MsbKernel kernel)
+  {
+    if (kernel == MsbKernel::Lzcnt && !cpu_features::get().lzcnt_) {
+      kernel = MsbKernel::Bsr;
+    }
+    return kernel;
+  }
+
+  MortonKernel clamp_morton_kernel(MortonKernel kernel)
+  {
+    if (kernel == MortonKernel::Bmi2 && !cpu_features::get().bmi2_) {
+      kernel = MortonKernel::Portable;
+    }
+    return kernel;
+  }
+
+  Msb64_t msb_kernel_for(MsbKernel kernel)
+  {
+    Msb64_t ret = msb64_portable;
+    switch (kernel) {
+    case MsbKernel::Lzcnt:
+      ret = msb64_lzcnt;
+      break;
+    case MsbKernel::Bsr:
+      ret = msb64_bsr;
+      break;
+    default:
+      break;
+    }
+    return ret;
+  }
+
+  MsbKernel g_msb_kernel = clamp_msb_kernel(MsbKernel::Lzcnt);
+  Msb64_t g_msb64 = msb_kernel_for(g_msb_kernel);
+  // A CPU reporting BMI2 can still run pdep and pext in slow microcode, so
+  // Bmi2 is only the default where they are fast.
+  MortonKernel g_morton_kernel = cpu_features::fast_bmi2() ?
+    MortonKernel::Bmi2 : MortonKernel::Portable;
+  Spread32_t g_spread32 = g_morton_kernel == MortonKernel::Bmi2 ?
+    spread32_bmi2 : spread32_portable;
+  Compact64_t g_compact64 = g_morton_kernel == MortonKernel::Bmi2 ?
+    compact64_bmi2 : compact64_portable;
+}
+
+int32_t __stdcall msb_index64(uint64_t x)
+{
+  return g_msb64(x);
+}
+
+uint64_t __stdcall spread_bits32(uint32_t x)
+{
+  return g_spread32(x);
+}
+
+uint32_t __stdcall compact_bits64(uint64_t x)
+{
+  return g_compact64(x);
+}
+
+MsbKernel __stdcall msb_kernel()
+{
+  return g_msb_kernel;
+}
+
+MsbKernel __stdcall set_msb_kernel(MsbKernel kernel)
+{
+  g_msb_kernel = clamp_msb_kernel(kernel);
+  g_msb64 = msb_kernel_for(g_msb_kernel);
+  return g_msb_kernel;
+}
+
+MortonKernel __stdcall morton_kernel()
+{
+  return g_morton_kernel;
+}
+
+MortonKernel __stdcall set_morton_kernel(MortonKernel kernel)
+{
+  g_morton_kernel = clamp_morton_kernel(kernel);
+  const bool bmi2 = g_morton_kernel == MortonKernel::Bmi2;
+  g_spread32 = bmi2 ? spread32_bmi2 : spread32_portable;
+  g_compact64 = bmi2 ? compact64_bmi2 : compact64_portable;
+  return g_morton_kernel;
+}
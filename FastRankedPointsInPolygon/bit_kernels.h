@@ -0,0 +1,83 @@
+#ifndef BIT_KERNELS_H
+#define BIT_KERNELS_H
+
+#include <cstdint>
+
+/// <summary>
+/// How <see cref="msb_index64"/> finds the most significant bit. Portable
+/// halves the search range with shifts, Bsr uses the bsr instruction every
+/// x64 CPU has and Lzcnt uses lzcnt, which is faster than bsr on some CPUs.
+/// </summary>
+enum class MsbKernel : int32_t {
+  Portable = 0,
+  Bsr = 1,
+  Lzcnt = 2
+};
+
+/// <summary>
+/// How <see cref="spread_bits32"/> and <see cref="compact_bits64"/> move
+/// bits. Portable uses shift and mask ladders, Bmi2 one pdep or pext.
+/// </summary>
+enum class MortonKernel : int32_t {
+  Portable = 0,
+  Bmi2 = 1
+};
+
+/// <summary>
+/// The index (0 based) of the most significant set bit of
+/// <paramref name="x"/>.
+/// </summary>
+/// <param name="x">The bits to search.</param>
+/// <returns>-1 if x == 0 otherwise an index from 0 to 63.</returns>
+__declspec(dllexport) int32_t __stdcall msb_index64(uint64_t x);
+
+/// <summary>
+/// Moves bit i of <paramref name="x"/> to bit 2 * i of the result, the
+/// even bits of a morton code.
+/// </summary>
+/// <param name="x">The bits to spread.</param>
+/// <returns><paramref name="x"/> with a zero bit after every bit.</returns>
+__declspec(dllexport) uint64_t __stdcall spread_bits32(uint32_t x);
+
+/// <summary>
+/// The inverse of <see cref="spread_bits32"/>. Moves bit 2 * i of
+/// <paramref name="x"/> to bit i of the result, odd bits are dropped.
+/// </summary>
+/// <param name="x">The bits to compact.</param>
+/// <returns>The even bits of <paramref name="x"/>.</returns>
+__declspec(dllexport) uint32_t __stdcall compact_bits64(uint64_t x);
+
+/// <summary>
+/// The kernel used by <see cref="msb_index64"/>. Picked from
+/// <see cref="cpu_features"/> when the DLL is loaded.
+/// </summary>
+/// <returns></returns>
+__declspec(dllexport) MsbKernel __stdcall msb_kernel();
+
+/// <summary>
+/// Forces the kernel used by <see cref="msb_index64"/>. Lzcnt falls back
+/// to Bsr on CPUs without it. Meant for testing and benchmarking.
+/// </summary>
+/// <param name="kernel">The kernel to use.</param>
+/// <returns>The kernel actually selected.</returns>
+__declspec(dllexport) MsbKernel __stdcall set_msb_kernel(MsbKernel kernel);
+
+/// <summary>
+/// The kernel used by <see cref="spread_bits32"/> and
+/// <see cref="compact_bits64"/>. Bmi2 when the DLL is loaded on a CPU
+/// where <see cref="cpu_features::fast_bmi2"/>, Portable otherwise.
+/// </summary>
+/// <returns></returns>
+__declspec(dllexport) MortonKernel __stdcall morton_kernel();
+
+/// <summary>
+/// Forces the kernel used by <see cref="spread_bits32"/> and
+/// <see cref="compact_bits64"/>. Bmi2 falls back to Portable on CPUs
+/// without it. Meant for testing and benchmarking.
+/// </summary>
+/// <param name="kernel">The kernel to use.</param>
+/// <returns>The kernel actually selected.</returns>
+__declspec(dllexport) MortonKernel __stdcall set_morton_kernel(
+  MortonKernel kernel);
+
+#endif
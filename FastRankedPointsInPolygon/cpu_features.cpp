@@ -0,0 +1,87 @@
+#include "cpu_features.h"
+
+#include <cstring>
+
+#include <intrin.h>
+
+const cpu_features& __stdcall cpu_features::get()
+{
+  static const cpu_features features = detect();
+  return features;
+}
+
+SimdLevel __stdcall cpu_features::best_simd_level()
+{
+  const cpu_features& features = get();
+  SimdLevel ret = SimdLevel::Scalar;
+  if (features.avx512f_) {
+    ret = SimdLevel::Avx512;
+  } else if (features.avx2_) {
+    ret = SimdLevel::Avx2;
+  }
+  return ret;
+}
+
+bool __stdcall cpu_features::fast_bmi2()
+{
+  const cpu_features& features = get();
+  return features.bmi2_ &&
+    !(features.vendor_ == CpuVendor::Amd && features.family_ < 0x19u);
+}
+
+cpu_features __stdcall cpu_features::detect()
+{
+  cpu_features ret = {
+    false, false, false, false, false, CpuVendor::Other, 0u
+  };
+
+  int info[4] = { 0, 0, 0, 0 };
+  __cpuid(info, 0);
+  const int max_leaf = info[0];
+  // The vendor string is spread over ebx, edx and ecx, in that order.
+  char vendor[13] = {};
+  std::memcpy(vendor, &info[1], 4);
+  std::memcpy(vendor + 4, &info[3], 4);
+  std::memcpy(vendor + 8, &info[2], 4);
+  if (std::strcmp(vendor, "GenuineIntel") == 0) {
+    ret.vendor_ = CpuVendor::Intel;
+  } else if (std::strcmp(vendor, "AuthenticAMD") == 0 ||
+    std::strcmp(vendor, "HygonGenuine") == 0) {
+    // Hygon cores are Zen 1 cores.
+    ret.vendor_ = CpuVendor::Amd;
+  }
+  __cpuid(info, 0x80000000);
+  const unsigned int max_extended_leaf = static_cast<unsigned int>(info[0]);
+
+  bool os_saves_ymm = false;
+  bool os_saves_zmm = false;
+  if (max_leaf >= 1) {
+    __cpuid(info, 1);
+    // The extended family only counts once the base family is 0xf.
+    const uint32_t base_family = (static_cast<uint32_t>(info[0]) >> 8) & 0xfu;
+    ret.family_ = base_family == 0xfu ? base_family +
+      ((static_cast<uint32_t>(info[0]) >> 20) & 0xffu) : base_family;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (osxsave && avx) {
+      const unsigned long long xcr0 = _xgetbv(0);
+      os_saves_ymm = (xcr0 & 0x6ull) == 0x6ull;
+      os_saves_zmm = (xcr0 & 0xE6ull) == 0xE6ull;
+    }
+  }
+
+  if (max_leaf >= 7) {
+    __cpuidex(info, 7, 0);
+    ret.avx2_ = os_saves_ymm && (info[1] & (1 << 5)) != 0;
+    ret.avx512f_ = os_saves_zmm && (info[1] & (1 << 16)) != 0;
+    ret.avx512bw_ = ret.avx512f_ && (info[1] & (1 << 30)) != 0;
+    ret.bmi2_ = (info[1] & (1 << 8)) != 0;
+  }
+
+  if (max_extended_leaf >= 0x80000001u) {
+    __cpuid(info, 0x80000001);
+    ret.lzcnt_ = (info[2] & (1 << 5)) != 0;
+  }
+
+  return ret;
+}
@@ -0,0 +1,63 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+#include <cstdint>
+
+/// <summary>
+/// The widest vector instruction set a kernel is allowed to use.
+/// </summary>
+enum class SimdLevel : int32_t {
+  Scalar = 0,
+  Avx2 = 1,
+  Avx512 = 2
+};
+
+/// <summary>
+/// The maker of the CPU, from the CPUID vendor string.
+/// </summary>
+enum class CpuVendor : int32_t {
+  Other = 0,
+  Intel = 1,
+  Amd = 2
+};
+
+/// <summary>
+/// The instruction set extensions of the CPU the DLL was loaded on, read
+/// once through CPUID. The vector extensions are only reported when the
+/// operating system also saves the matching register state.
+/// </summary>
+struct __declspec(dllexport) cpu_features
+{
+  bool avx2_;
+  bool avx512f_;
+  bool avx512bw_;
+  bool bmi2_;
+  bool lzcnt_;
+  CpuVendor vendor_;
+  uint32_t family_;
+
+  /// <summary>
+  /// The features of the current CPU.
+  /// </summary>
+  /// <returns></returns>
+  static const cpu_features& __stdcall get();
+
+  /// <summary>
+  /// The widest <see cref="SimdLevel"/> the current CPU supports.
+  /// </summary>
+  /// <returns></returns>
+  static SimdLevel __stdcall best_simd_level();
+
+  /// <summary>
+  /// Whether pdep and pext are single fast instructions on the current
+  /// CPU. AMD CPUs before Zen 3, family 0x19, report BMI2 but run both in
+  /// microcode, with a latency that grows with the number of mask bits.
+  /// </summary>
+  /// <returns></returns>
+  static bool __stdcall fast_bmi2();
+
+private:
+  static cpu_features __stdcall detect();
+};
+
+#endif
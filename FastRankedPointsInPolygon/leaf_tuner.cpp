@@ -0,0 +1,158 @@
+#include "leaf_tuner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace
+{
+  constexpr std::size_t TIMED_PASSES = 3ull;
+
+  // Rects are centered on sampled points with half extents of these
+  // fractions of the sample bounds, from a handful of hits to most of the
+  // set.
+  constexpr float QUERY_FRACTIONS[] = {
+    1.0f / 256.0f, 1.0f / 64.0f, 1.0f / 16.0f, 1.0f / 4.0f
+  };
+
+  std::vector<Rect> generate_queries(const std::vector<Point>& sample,
+    std::size_t query_count)
+  {
+    std::vector<const Point*> finite;
+    finite.reserve(sample.size());
+    Rect bounds = {
+      (std::numeric_limits<float>::max)(),
+      (std::numeric_limits<float>::max)(),
+      std::numeric_limits<float>::lowest(),
+      std::numeric_limits<float>::lowest()
+    };
+    for (const Point& p : sample) {
+      if (std::isfinite(p.x) && std::isfinite(p.y)) {
+        finite.push_back(&p);
+        bounds.lx = (std::min)(bounds.lx, p.x);
+        bounds.ly = (std::min)(bounds.ly, p.y);
+        bounds.hx = (std::max)(bounds.hx, p.x);
+        bounds.hy = (std::max)(bounds.hy, p.y);
+      }
+    }
+
+    std::vector<Rect> queries;
+    if (finite.empty()) {
+      return queries;
+    }
+    const float width = bounds.hx - bounds.lx;
+    const float height = bounds.hy - bounds.ly;
+    const std::size_t fractions =
+      sizeof(QUERY_FRACTIONS) / sizeof(QUERY_FRACTIONS[0]);
+
+    // A fixed seed keeps the tuning of the same points repeatable.
+    std::mt19937 engine(5489u);
+    queries.reserve(query_count);
+    for (std::size_t i = 0; i < query_count; ++i) {
+      const Point* center = finite[engine() % finite.size()];
+      const float fraction = QUERY_FRACTIONS[i % fractions];
+      queries.push_back({
+        center->x - width * fraction, center->y - height * fraction,
+        center->x + width * fraction, center->y + height * fraction });
+    }
+    return queries;
+  }
+
+  // The best of TIMED_PASSES replays of every query, in nanoseconds per
+  // query, after one untimed replay to warm the caches.
+  double time_queries(quad_tree& tree, const std::vector<Rect>& queries,
+    int32_t count, std::vector<Point>& out_points,
+    std::vector<int32_t>& out_counts)
+  {
+    replay_queries(tree, queries.data(), queries.size(), count,
+      out_points.data(), out_counts.data());
+
+    double best = (std::numeric_limits<double>::max)();
+    for (std::size_t pass = 0; pass < TIMED_PASSES; ++pass) {
+      auto start = std::chrono::steady_clock::now();
+      replay_queries(tree, queries.data(), queries.size(), count,
+        out_points.data(), out_counts.data());
+      std::chrono::duration<double, std::nano> nanos =
+        std::chrono::steady_clock::now() - start;
+      best = (std::min)(best, nanos.count());
+    }
+    return best / static_cast<double>(queries.size());
+  }
+}
+
+__declspec(dllexport) void __stdcall replay_queries(
+  quad_tree& tree,
+  const Rect* queries,
+  const std::size_t query_count,
+  const int32_t count,
+  Point* out_points,
+  int32_t* out_counts)
+{
+  for (std::size_t i = 0; i < query_count; ++i) {
+    // quad_tree::query continues from the points already in out_points,
+    // every query has to start from none.
+    out_counts[i] = 0;
+    tree.query(queries[i], count, out_counts[i], out_points + i * count);
+  }
+}
+
+__declspec(dllexport) TuneResult __stdcall tune_quad_tree(
+  const Point* point_begin,
+  const Point* point_end,
+  const TuneWorkload& workload,
+  const quad_tree::BuildOptions& options)
+{
+  const std::size_t size = std::distance(point_begin, point_end);
+  const std::size_t sample_size = (std::max)(std::size_t(1),
+    (std::min)(size, workload.sample_size));
+  const std::size_t stride = size / sample_size;
+  std::vector<Point> sample;
+  sample.reserve(sample_size);
+  for (std::size_t i = 0; i < sample_size; ++i) {
+    sample.push_back(point_begin[i * stride]);
+  }
+
+  std::vector<Rect> queries;
+  if (workload.queries != nullptr && workload.query_count > 0) {
+    queries.assign(workload.queries,
+      workload.queries + workload.query_count);
+  } else {
+    queries = generate_queries(sample, TuneWorkload::GENERATED_QUERIES);
+  }
+  const int32_t count = (std::max)(workload.result_count, 1);
+  std::vector<Point> out_points(queries.size() * count);
+  std::vector<int32_t> out_counts(queries.size());
+
+  TuneResult ret = { TUNE_LEAF_SIZES[0], quad_tree::SplitPolicy::Midpoint,
+    sample_size, queries.size(), 0.0 };
+  if (queries.empty()) {
+    return ret;
+  }
+
+  ret.nanos_per_query = (std::numeric_limits<double>::max)();
+  for (std::size_t leaf_size : TUNE_LEAF_SIZES) {
+    // A leaf as large as the sample is a single scan, which says nothing
+    // about how the leaf size behaves on the full set.
+    if (leaf_size != TUNE_LEAF_SIZES[0] && leaf_size >= sample_size) {
+      break;
+    }
+    for (quad_tree::SplitPolicy policy : { quad_tree::SplitPolicy::Midpoint,
+      quad_tree::SplitPolicy::Median, quad_tree::SplitPolicy::SurfaceArea }) {
+      quad_tree::BuildOptions candidate = options;
+      candidate.split_policy = policy;
+      quad_tree tree(sample.data(), sample.data() + sample.size(),
+        quad_tree::MIN_BLOCK_SIZE, leaf_size, candidate);
+      const double nanos = time_queries(tree, queries, count, out_points,
+        out_counts);
+      if (nanos < ret.nanos_per_query) {
+        ret.max_block_size = leaf_size;
+        ret.split_policy = policy;
+        ret.nanos_per_query = nanos;
+      }
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,110 @@
+#ifndef LEAF_TUNER_H
+#define LEAF_TUNER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "ipoint_search.h"
+#include "quad_tree.h"
+
+/// <summary>
+/// The quad_tree parameters picked by <see cref="tune_quad_tree"/> and how
+/// fast the winner answered the tuning workload.
+/// </summary>
+struct TuneResult
+{
+  std::size_t max_block_size;
+  quad_tree::SplitPolicy split_policy;
+  std::size_t sample_size;
+  std::size_t query_count;
+  double nanos_per_query;
+};
+
+/// <summary>
+/// The leaf sizes tried by <see cref="tune_quad_tree"/>.
+/// </summary>
+constexpr std::size_t TUNE_LEAF_SIZES[] = { 16ull, 64ull, 256ull, 1024ull };
+
+/// <summary>
+/// The queries <see cref="tune_quad_tree"/> replays against every
+/// candidate tree.
+/// </summary>
+struct TuneWorkload
+{
+  constexpr static std::size_t SAMPLE_SIZE = 65536ull;
+  constexpr static std::size_t GENERATED_QUERIES = 256ull;
+  constexpr static int32_t RESULT_COUNT = 20;
+
+  /// <summary>
+  /// Queries representative of the expected load. When nullptr
+  /// <see cref="TuneWorkload::GENERATED_QUERIES"/> rects of several sizes
+  /// centered on sampled points are used instead.
+  /// </summary>
+  const Rect* queries = nullptr;
+
+  std::size_t query_count = 0;
+
+  /// <summary>
+  /// The number of points asked for by every query.
+  /// </summary>
+  int32_t result_count = RESULT_COUNT;
+
+  /// <summary>
+  /// The number of points, taken at an even stride, the candidate trees
+  /// are built over.
+  /// </summary>
+  std::size_t sample_size = SAMPLE_SIZE;
+};
+
+/// <summary>
+/// Builds a quad_tree over a sample of the points for every pair of
+/// <see cref="TUNE_LEAF_SIZES"/> and <see cref="quad_tree::SplitPolicy"/>,
+/// replays <paramref name="workload"/> against each and returns the pair
+/// with the lowest time per query. Every node of a quad_tree has four
+/// children, so the split policy is the only shape knob besides the leaf
+/// size. The leaf size decides how many points a query filters per leaf,
+/// which does not depend on the total, so the winner carries over from the
+/// sample to the full set.
+/// </summary>
+/// <param name="point_begin">
+/// The first Point in the array of points.
+/// </param>
+/// <param name="point_end">
+/// One address past the end Point in the array of points.
+/// </param>
+/// <param name="workload">The queries to time.</param>
+/// <param name="options">
+/// The settings of the tree being tuned for. Its split_policy is ignored.
+/// </param>
+/// <returns></returns>
+__declspec(dllexport) TuneResult __stdcall tune_quad_tree(
+  const Point* point_begin,
+  const Point* point_end,
+  const TuneWorkload& workload,
+  const quad_tree::BuildOptions& options);
+
+/// <summary>
+/// Runs every query of <paramref name="queries"/> against
+/// <paramref name="tree"/>, the way <see cref="tune_quad_tree"/> times a
+/// candidate. Every query starts from an empty result.
+/// </summary>
+/// <param name="tree">The tree to query.</param>
+/// <param name="queries">The rects to search.</param>
+/// <param name="query_count">The number of rects.</param>
+/// <param name="count">The number of points asked for by every query.</param>
+/// <param name="out_points">
+/// <paramref name="count"/> points per query, the results of query i start
+/// at out_points + i * count.
+/// </param>
+/// <param name="out_counts">
+/// The number of points found by each query.
+/// </param>
+__declspec(dllexport) void __stdcall replay_queries(
+  quad_tree& tree,
+  const Rect* queries,
+  const std::size_t query_count,
+  const int32_t count,
+  Point* out_points,
+  int32_t* out_counts);
+
+#endif
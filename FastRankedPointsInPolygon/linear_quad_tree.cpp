@@ -0,0 +1,199 @@
+#include "linear_quad_tree.h"
+
+#include "query_helpers.h"
+#include "query_scratch.h"
+#include "radix_sort.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+__stdcall linear_quad_tree::linear_quad_tree(
+  const Point* point_begin,
+  const Point* point_end,
+  const std::size_t max_block_size) :
+  global_bounds_({})
+{
+  if (point_begin == nullptr || point_end == nullptr ||
+    point_begin == point_end) {
+    return;
+  }
+
+  std::size_t size = std::distance(point_begin, point_end);
+  if (size > (std::numeric_limits<uint32_t>::max)()) {
+    throw std::runtime_error(std::string(__FUNCTION__) +
+      " cannot index more than " +
+      std::to_string((std::numeric_limits<uint32_t>::max)()) + " points.");
+  }
+
+  quad_tree::compute_bounds(point_begin, point_end, global_bounds_);
+
+  const uint8_t depth = quad_tree::max_depth();
+  std::vector<uint64_t> keys(size);
+  std::vector<uint32_t> order(size);
+  quad_tree::compute_quad_keys(point_begin, size, depth, global_bounds_,
+    keys.data());
+  for (std::size_t i = 0; i < size; ++i) {
+    order[i] = static_cast<uint32_t>(i);
+  }
+  radix_sort(keys, order);
+
+  points_.resize(size);
+  for (std::size_t i = 0; i < size; ++i) {
+    points_[i] = point_begin[order[i]];
+  }
+  order.clear();
+  order.shrink_to_fit();
+
+  build_nodes(keys, max_block_size);
+  summarize_nodes();
+}
+
+void __stdcall linear_quad_tree::build_nodes(
+  const std::vector<uint64_t>& keys,
+  const std::size_t max_block_size)
+{
+  const uint8_t max_depth = quad_tree::max_depth();
+
+  nodes_.push_back(node{ {}, 0u, 0u, 0u,
+    static_cast<uint32_t>(points_.size()),
+    (std::numeric_limits<int32_t>::max)() });
+  std::vector<uint8_t> depths(1, 0u);
+
+  // Nodes are appended level by level, so the children of a node always
+  // follow it in the table and sit next to each other.
+  for (std::size_t i = 0; i < nodes_.size(); ++i) {
+    const uint32_t begin = nodes_[i].begin_;
+    const uint32_t end = nodes_[i].end_;
+    const uint8_t depth = depths[i];
+
+    if (end - begin > max_block_size && depth < max_depth) {
+      const uint64_t shift = 2ull * (max_depth - (depth + 1u));
+      const uint32_t first_child = static_cast<uint32_t>(nodes_.size());
+      auto child_begin = keys.begin() + begin;
+      for (uint64_t quadrant = 0; quadrant < 4; ++quadrant) {
+        auto child_end = std::partition_point(child_begin,
+          keys.begin() + end,
+          [&](uint64_t key)
+          {
+            return ((key >> shift) & 0x3ull) <= quadrant;
+          });
+        if (child_end != child_begin) {
+          nodes_.push_back(node{ {}, 0u, 0u,
+            static_cast<uint32_t>(child_begin - keys.begin()),
+            static_cast<uint32_t>(child_end - keys.begin()),
+            (std::numeric_limits<int32_t>::max)() });
+          depths.push_back(depth + 1u);
+        }
+        child_begin = child_end;
+      }
+      nodes_[i].first_child_ = first_child;
+      nodes_[i].child_count_ =
+        static_cast<uint32_t>(nodes_.size()) - first_child;
+    } else {
+      std::sort(points_.begin() + begin, points_.begin() + end,
+        [](const Point& lhs, const Point& rhs)
+        {
+          return lhs.rank < rhs.rank;
+        });
+    }
+  }
+  nodes_.shrink_to_fit();
+}
+
+void __stdcall linear_quad_tree::summarize_nodes()
+{
+  // Children always have larger indices than their parent.
+  for (std::size_t i = nodes_.size(); i > 0; --i) {
+    node& curr = nodes_[i - 1];
+    if (curr.child_count_ == 0) {
+      quad_tree::compute_bounds(points_.data() + curr.begin_,
+        points_.data() + curr.end_, curr.point_bounds_);
+      curr.min_rank_ = points_[curr.begin_].rank;
+    } else {
+      curr.point_bounds_ = nodes_[curr.first_child_].point_bounds_;
+      for (uint32_t c = 0; c < curr.child_count_; ++c) {
+        const node& child = nodes_[curr.first_child_ + c];
+        curr.point_bounds_.lx = (std::min)(curr.point_bounds_.lx,
+          child.point_bounds_.lx);
+        curr.point_bounds_.ly = (std::min)(curr.point_bounds_.ly,
+          child.point_bounds_.ly);
+        curr.point_bounds_.hx = (std::max)(curr.point_bounds_.hx,
+          child.point_bounds_.hx);
+        curr.point_bounds_.hy = (std::max)(curr.point_bounds_.hy,
+          child.point_bounds_.hy);
+        curr.min_rank_ = (std::min)(curr.min_rank_, child.min_rank_);
+      }
+    }
+  }
+}
+
+void __stdcall linear_quad_tree::query(
+  const Rect& query_rect,
+  const int32_t count,
+  int32_t& end_i,
+  Point* out_points) const
+{
+  if (nodes_.empty()) {
+    return;
+  }
+
+  DoubleRect bounds = {
+    query_rect.lx,
+    query_rect.ly,
+    query_rect.hx,
+    query_rect.hy
+  };
+
+  top_k_buffer<int32_t> results(count, out_points, end_i);
+
+  typedef std::pair<int32_t, uint32_t> RankedNode_t;
+  scratch_heap<RankedNode_t> queue(thread_scratch<RankedNode_t>());
+  queue.push(std::make_pair(nodes_[0].min_rank_, 0u));
+
+  while (not queue.empty()) {
+    const node& curr = nodes_[queue.top().second];
+    if (queue.top().first > results.threshold()) {
+      // Every node left in the queue only holds higher ranks.
+      break;
+    }
+    queue.pop();
+    Overlap overlap = classify(bounds, curr.point_bounds_);
+    if (overlap == Overlap::Disjoint) {
+      continue;
+    } else if (curr.child_count_ == 0) {
+      const Point* points = points_.data() + curr.begin_;
+      const std::size_t size = curr.end_ - curr.begin_;
+      if (overlap == Overlap::Contained) {
+        insert_contained_points(points, size, results);
+      } else {
+        insert_leaf_points(points, size, bounds, results);
+      }
+    } else {
+      for (uint32_t c = 0; c < curr.child_count_; ++c) {
+        const uint32_t child = curr.first_child_ + c;
+        queue.push(std::make_pair(nodes_[child].min_rank_, child));
+      }
+    }
+  }
+  end_i = results.copy_to(out_points);
+}
+
+const DoubleRect& __stdcall linear_quad_tree::global_bounds() const
+{
+  return global_bounds_;
+}
+
+std::size_t __stdcall linear_quad_tree::size() const
+{
+  return points_.size();
+}
+
+std::size_t __stdcall linear_quad_tree::node_count() const
+{
+  return nodes_.size();
+}
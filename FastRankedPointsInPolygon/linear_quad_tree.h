@@ -0,0 +1,98 @@
+#ifndef LINEAR_QUAD_TREE_H
+#define LINEAR_QUAD_TREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ipoint_search.h"
+#include "quad_tree.h"
+
+/// <summary>
+/// A pointer free quad_tree. All points are sorted by their morton encoded
+/// quad_key, see <see cref="quad_tree::compute_quad_key"/>, at
+/// <see cref="quad_tree::max_depth"/> into one contiguous array. In that
+/// order every node of the tree owns a contiguous range of the array, so the
+/// tree itself is a flat table of nodes holding their range, bounds and the
+/// minimum rank underneath them. Children of a node are stored next to each
+/// other in the table and are addressed by index, which keeps the whole
+/// index relocatable and its memory access predictable.
+/// </summary>
+class __declspec(dllexport) linear_quad_tree
+{
+private:
+  struct node
+  {
+    DoubleRect point_bounds_;
+    uint32_t first_child_;
+    uint32_t child_count_;
+    uint32_t begin_;
+    uint32_t end_;
+    int32_t min_rank_;
+  };
+
+public:
+  /// <summary>
+  /// Constructor for a linear_quad_tree created from a contiguous block of
+  /// <see cref="Point"/> between the addresses stored by
+  /// <paramref name="point_begin"/> and <paramref name="point_end"/>
+  /// </summary>
+  /// <param name="point_begin">
+  /// The first Point in the array of points.
+  /// </param>
+  /// <param name="point_end">
+  /// One address past the end Point in the array of points.
+  /// </param>
+  /// <param name="max_block_size">
+  /// The maximum number of points allowed in a leaf.
+  /// </param>
+  __stdcall linear_quad_tree(
+    const Point* point_begin,
+    const Point* point_end,
+    const std::size_t max_block_size = quad_tree::MAX_BLOCK_SIZE);
+
+  /// <summary>
+  /// Fills <paramref name="out_points"/> with up to
+  /// <paramref name="count"/> points inside <paramref name="query_rect"/>
+  /// sorted by rank, see <see cref="quad_tree::query"/>.
+  /// </summary>
+  /// <param name="query_rect">The query_rect.</param>
+  /// <param name="count">The maximum number of points wanted.</param>
+  /// <param name="end_i">
+  /// Output parameter with the number of points inserted.
+  /// </param>
+  /// <param name="out_points">The sorted points by rank.</param>
+  void __stdcall query(const Rect& query_rect, const int32_t count,
+    int32_t& end_i, Point* out_points) const;
+
+  /// <summary>
+  /// The smallest axis aligned bounding box of all points in the tree.
+  /// </summary>
+  /// <returns></returns>
+  const DoubleRect& __stdcall global_bounds() const;
+
+  /// <summary>
+  /// The number of points stored within the tree.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall size() const;
+
+  /// <summary>
+  /// The number of entries in the flat node table.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall node_count() const;
+
+private:
+  void __stdcall build_nodes(const std::vector<uint64_t>& keys,
+    const std::size_t max_block_size);
+
+  void __stdcall summarize_nodes();
+
+private:
+  std::vector<Point> points_;
+  std::vector<node> nodes_;
+  DoubleRect global_bounds_;
+};
+
+#endif
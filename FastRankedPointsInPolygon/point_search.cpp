@@ -45,15 +45,101 @@ void write_churchill_points_to_file(const Point* begin, const Point* end,
 }
 
 ///////// Search Context /////////
-SearchContext::SearchContext(cPointPtr points_begin, cPointPtr points_end)
+namespace
+{
+  // The plan of the last search run on this thread by a Planned context.
+  // Threads share contexts, so the plan is kept per thread rather than in
+  // the context.
+  struct planned_search
+  {
+    const SearchContext* context;
+    QueryPlan plan;
+  };
+
+  thread_local planned_search last_planned = {
+    nullptr, { QueryStrategy::TreeTraversal, 0.0, 0.0, 0.0 }
+  };
+
+  // The quad_tree of a QuadTree or Planned context, built and set up as
+  // options asks.
+  quad_tree* build_quad_tree(const Point* points_begin,
+    const Point* points_end, const SearchOptions& options)
+  {
+    quad_tree::BuildOptions build_options;
+    build_options.compact_nodes = options.compact_nodes;
+    build_options.leaf_layout = options.leaf_layout;
+    build_options.build_threads = options.build_threads;
+    build_options.bulk_load = options.bulk_load;
+    build_options.split_policy = options.split_policy;
+    quad_tree* ret = new quad_tree(points_begin, points_end, 5,
+      options.max_block_size, build_options);
+    ret->set_query_mode(options.query_mode);
+    ret->set_prefetch_distance(options.prefetch_distance);
+    return ret;
+  }
+}
+
+SearchContext::SearchContext(cPointPtr points_begin, cPointPtr points_end,
+  const SearchOptions& options) :
+  options_(options),
+  quad_tree_(nullptr),
+  linear_quad_tree_(nullptr),
+  priority_kd_tree_(nullptr),
+  rank_scan_(nullptr),
+  query_planner_(nullptr),
+  tuning_({ 0u, quad_tree::SplitPolicy::Midpoint, 0u, 0u, 0.0 })
 {
   std::ptrdiff_t size = std::distance(points_begin, points_end);
-  quad_tree_ = new quad_tree(points_begin, points_end, 5, size / 512);
+  const bool tunes_quad_tree = options_.engine == SearchEngine::QuadTree ||
+    options_.engine == SearchEngine::Planned;
+  if (options_.max_block_size == 0 && options_.auto_tune &&
+    tunes_quad_tree) {
+    quad_tree::BuildOptions build_options;
+    build_options.compact_nodes = options_.compact_nodes;
+    build_options.leaf_layout = options_.leaf_layout;
+    build_options.bulk_load = options_.bulk_load;
+    tuning_ = tune_quad_tree(points_begin, points_end,
+      options_.tune_workload, build_options);
+    options_.max_block_size = tuning_.max_block_size;
+    options_.split_policy = tuning_.split_policy;
+  } else if (options_.max_block_size == 0) {
+    options_.max_block_size = (std::max)(
+      static_cast<std::size_t>(size / 512), quad_tree::MIN_BLOCK_SIZE);
+  }
+
+  switch (options_.engine) {
+  case SearchEngine::Planned:
+    quad_tree_ = build_quad_tree(points_begin, points_end, options_);
+    rank_scan_ = new rank_scan(points_begin, points_end);
+    query_planner_ = new query_planner(points_begin, points_end,
+      options_.max_block_size);
+    break;
+  case SearchEngine::QuadTree:
+    quad_tree_ = build_quad_tree(points_begin, points_end, options_);
+    break;
+  case SearchEngine::LinearQuadTree:
+    linear_quad_tree_ = new linear_quad_tree(points_begin, points_end,
+      options_.max_block_size);
+    break;
+  case SearchEngine::PriorityKdTree:
+    priority_kd_tree_ = new priority_kd_tree(points_begin, points_end);
+    break;
+  case SearchEngine::RankScan:
+    rank_scan_ = new rank_scan(points_begin, points_end);
+    break;
+  }
 }
 
 SearchContext::~SearchContext()
 {
   delete quad_tree_;
+  delete linear_quad_tree_;
+  delete priority_kd_tree_;
+  delete rank_scan_;
+  delete query_planner_;
+  if (last_planned.context == this) {
+    last_planned.context = nullptr;
+  }
 }
 
 quad_tree*& SearchContext::tree()
@@ -61,6 +147,76 @@ quad_tree*& SearchContext::tree()
   return quad_tree_;
 }
 
+const quad_tree* SearchContext::tree() const
+{
+  return quad_tree_;
+}
+
+linear_quad_tree*& SearchContext::linear_tree()
+{
+  return linear_quad_tree_;
+}
+
+priority_kd_tree*& SearchContext::kd_tree()
+{
+  return priority_kd_tree_;
+}
+
+rank_scan*& SearchContext::scan()
+{
+  return rank_scan_;
+}
+
+QueryPlan SearchContext::last_plan() const
+{
+  if (last_planned.context != this) {
+    return { QueryStrategy::TreeTraversal, 0.0, 0.0, 0.0 };
+  }
+  return last_planned.plan;
+}
+
+QueryPlan SearchContext::explain(const Rect& rect, const int32_t count) const
+{
+  return query_planner_->plan(rect, count);
+}
+
+const SearchOptions& SearchContext::options() const
+{
+  return options_;
+}
+
+const TuneResult& SearchContext::tuning() const
+{
+  return tuning_;
+}
+
+void SearchContext::query(const Rect& rect, const int32_t count,
+  int32_t& end_i, Point* out_points)
+{
+  switch (options_.engine) {
+  case SearchEngine::QuadTree:
+    quad_tree_->query(rect, count, end_i, out_points);
+    break;
+  case SearchEngine::LinearQuadTree:
+    linear_quad_tree_->query(rect, count, end_i, out_points);
+    break;
+  case SearchEngine::PriorityKdTree:
+    priority_kd_tree_->query(rect, count, end_i, out_points);
+    break;
+  case SearchEngine::RankScan:
+    rank_scan_->query(rect, count, end_i, out_points);
+    break;
+  case SearchEngine::Planned:
+    last_planned = { this, query_planner_->plan(rect, count) };
+    if (last_planned.plan.strategy == QueryStrategy::RankScan) {
+      rank_scan_->query(rect, count, end_i, out_points);
+    } else {
+      quad_tree_->query(rect, count, end_i, out_points);
+    }
+    break;
+  }
+}
+
 std::ofstream& SearchContext::write()
 {
   return write_;
@@ -95,12 +251,21 @@ __declspec(dllexport) bool __stdcall intersect_point(
 __declspec(dllexport) SearchContext* __stdcall create(
   const Point *points_begin,
   const Point *points_end)
+{
+  return create_with_options(points_begin, points_end, nullptr);
+}
+
+__declspec(dllexport) SearchContext* __stdcall create_with_options(
+  const Point *points_begin,
+  const Point *points_end,
+  const SearchOptions* options)
 {
   SearchContext* sc = nullptr;
 
   std::ptrdiff_t points_count = std::distance(points_begin, points_end);
   if (points_count > 0) {
-    sc = new SearchContext(points_begin, points_end);
+    sc = new SearchContext(points_begin, points_end,
+      options != nullptr ? *options : SearchOptions());
   }
 
   return sc;
@@ -119,11 +284,64 @@ __declspec(dllexport) int32_t __stdcall search(
   }
 
   int32_t end_i = 0;
-  sc->tree()->query(rect, count, end_i, out_points);
+  sc->query(rect, count, end_i, out_points);
 
   return end_i;
 }
 
+__declspec(dllexport) bool __stdcall last_query_plan(
+  const SearchContext* sc,
+  QueryPlan* out_plan)
+{
+  if (sc == nullptr || out_plan == nullptr ||
+    sc->options().engine != SearchEngine::Planned) {
+    return false;
+  }
+
+  *out_plan = sc->last_plan();
+  return true;
+}
+
+__declspec(dllexport) bool __stdcall explain_query(
+  const SearchContext* sc,
+  const Rect rect,
+  const int32_t count,
+  QueryPlan* out_plan)
+{
+  if (sc == nullptr || out_plan == nullptr ||
+    sc->options().engine != SearchEngine::Planned) {
+    return false;
+  }
+
+  *out_plan = sc->explain(rect, count);
+  return true;
+}
+
+__declspec(dllexport) bool __stdcall build_memory(
+  const SearchContext* sc,
+  quad_tree::BuildStats* out_stats)
+{
+  if (sc == nullptr || out_stats == nullptr || sc->tree() == nullptr) {
+    return false;
+  }
+
+  *out_stats = sc->tree()->build_stats();
+  return true;
+}
+
+__declspec(dllexport) bool __stdcall tuned_parameters(
+  const SearchContext* sc,
+  TuneResult* out_tuning)
+{
+  if (sc == nullptr || out_tuning == nullptr ||
+    sc->tuning().sample_size == 0) {
+    return false;
+  }
+
+  *out_tuning = sc->tuning();
+  return true;
+}
+
 __declspec(dllexport) SearchContext* __stdcall destroy(
   SearchContext *sc)
 {
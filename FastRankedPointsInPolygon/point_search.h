@@ -8,22 +8,166 @@
 #include <tuple>
 #include <vector>
 
+#include "leaf_tuner.h"
+#include "linear_quad_tree.h"
+#include "priority_kd_tree.h"
+#include "query_planner.h"
+#include "rank_scan.h"
 #include "quad_tree.h"
 
+/// <summary>
+/// The index a <see cref="SearchContext"/> builds and answers searches
+/// with. PriorityKdTree trades slower typical queries for a bound that does
+/// not depend on the rank distribution, see <see cref="priority_kd_tree"/>.
+/// RankScan suits query rects covering most of the points, see
+/// <see cref="rank_scan"/>. Planned builds both a QuadTree and a RankScan
+/// and lets a <see cref="query_planner"/> pick one per search.
+/// </summary>
+enum class SearchEngine : int32_t {
+  QuadTree = 0,
+  LinearQuadTree = 1,
+  PriorityKdTree = 2,
+  RankScan = 3,
+  Planned = 4
+};
+
+/// <summary>
+/// Settings used by <see cref="create_with_options"/> when building a
+/// <see cref="SearchContext"/>.
+/// </summary>
+struct SearchOptions
+{
+  /// <summary>
+  /// The index to build.
+  /// </summary>
+  SearchEngine engine = SearchEngine::QuadTree;
+
+  /// <summary>
+  /// The maximum number of points in a leaf. 0 picks size / 512, but no
+  /// less than <see cref="quad_tree::MIN_BLOCK_SIZE"/>, unless auto_tune
+  /// is set.
+  /// </summary>
+  std::size_t max_block_size = 0;
+
+  /// <summary>
+  /// Emit the quad_tree as cache line sized nodes, see
+  /// <see cref="quad_tree::BuildOptions::compact_nodes"/>.
+  /// </summary>
+  bool compact_nodes = false;
+
+  /// <summary>
+  /// Leaf storage of the quad_tree engine, see
+  /// <see cref="quad_tree::BuildOptions::leaf_layout"/>.
+  /// </summary>
+  quad_tree::LeafLayout leaf_layout = quad_tree::LeafLayout::Packed;
+
+  /// <summary>
+  /// Threads building the quad_tree engine, see
+  /// <see cref="quad_tree::BuildOptions::build_threads"/>.
+  /// </summary>
+  std::size_t build_threads = 1;
+
+  /// <summary>
+  /// Bulk load the quad_tree engine from radix sorted morton keys, see
+  /// <see cref="quad_tree::BuildOptions::bulk_load"/>.
+  /// </summary>
+  bool bulk_load = false;
+
+  /// <summary>
+  /// Where the quad_tree engine cuts its nodes, see
+  /// <see cref="quad_tree::SplitPolicy"/>. Median or SurfaceArea keep the
+  /// tree shallow on clustered data.
+  /// </summary>
+  quad_tree::SplitPolicy split_policy = quad_tree::SplitPolicy::Midpoint;
+
+  /// <summary>
+  /// The traversal of the quad_tree engine, see
+  /// <see cref="quad_tree::QueryMode"/>. Compact trees always run best
+  /// first.
+  /// </summary>
+  quad_tree::QueryMode query_mode = quad_tree::QueryMode::BestFirst;
+
+  /// <summary>
+  /// How far ahead the quad_tree engine prefetches leaf points when
+  /// <see cref="SearchOptions::query_mode"/> is breadth first, see
+  /// <see cref="quad_tree::set_prefetch_distance"/>. The other modes and
+  /// compact trees only tell 0, which disables prefetching, from non-zero.
+  /// </summary>
+  std::size_t prefetch_distance = quad_tree::PREFETCH_DISTANCE;
+
+  /// <summary>
+  /// When set and max_block_size is 0, the quad_tree of the QuadTree and
+  /// Planned engines takes its leaf size and split policy from
+  /// <see cref="tune_quad_tree"/> run with tune_workload, and ignores
+  /// split_policy. The choice is recorded in the context, see
+  /// <see cref="SearchContext::tuning"/>.
+  /// </summary>
+  bool auto_tune = false;
+
+  /// <summary>
+  /// The queries and sample used by auto_tune.
+  /// </summary>
+  TuneWorkload tune_workload;
+};
+
 struct __declspec(dllexport) SearchContext
 {
 public:
   typedef const Point* cPointPtr;
-  SearchContext(cPointPtr points_begin, cPointPtr points_end);
+  SearchContext(cPointPtr points_begin, cPointPtr points_end,
+    const SearchOptions& options = SearchOptions());
 
   ~SearchContext();
 
   quad_tree*& tree();
 
+  const quad_tree* tree() const;
+
+  linear_quad_tree*& linear_tree();
+
+  priority_kd_tree*& kd_tree();
+
+  rank_scan*& scan();
+
+  /// <summary>
+  /// The plan of the last query the calling thread ran on this
+  /// <see cref="SearchEngine::Planned"/> context. A tree traversal with no
+  /// estimates until the thread has run one, or when its last planned query
+  /// went to another context.
+  /// </summary>
+  QueryPlan last_plan() const;
+
+  /// <summary>
+  /// The plan a <see cref="SearchEngine::Planned"/> context would use for
+  /// a query, without running it.
+  /// </summary>
+  QueryPlan explain(const Rect& rect, const int32_t count) const;
+
+  /// <summary>
+  /// The options the context was built with, with the leaf size and split
+  /// policy it settled on.
+  /// </summary>
+  const SearchOptions& options() const;
+
+  /// <summary>
+  /// The outcome of auto tuning, all zero when
+  /// <see cref="SearchOptions::auto_tune"/> did not run.
+  /// </summary>
+  const TuneResult& tuning() const;
+
+  void query(const Rect& rect, const int32_t count, int32_t& end_i,
+    Point* out_points);
+
   std::ofstream& write();
 
 private:
+  SearchOptions options_;
   quad_tree* quad_tree_;
+  linear_quad_tree* linear_quad_tree_;
+  priority_kd_tree* priority_kd_tree_;
+  rank_scan* rank_scan_;
+  query_planner* query_planner_;
+  TuneResult tuning_;
   std::ofstream write_;
 };
 
@@ -62,11 +206,59 @@ extern "C" __declspec(dllexport) SearchContext* __stdcall create(
 	const Point* points_end
 );
 
+/*
+ * Same as create but builds the index described by "options". A nullptr
+ * "options" behaves like create.
+ */
+extern "C" __declspec(dllexport) SearchContext* __stdcall create_with_options(
+	const Point* points_begin,
+	const Point* points_end,
+	const SearchOptions* options
+);
+
 extern "C" __declspec(dllexport) int32_t __stdcall search(
 	SearchContext* sc,
 	const Rect rect,
 	const int32_t count, Point* out_points);
 
+/*
+ * Copies the plan of the last search the calling thread ran on "sc" into
+ * "out_plan". Returns false when "sc" was not created with
+ * SearchEngine::Planned.
+ */
+extern "C" __declspec(dllexport) bool __stdcall last_query_plan(
+	const SearchContext* sc,
+	QueryPlan* out_plan);
+
+/*
+ * Copies the plan "sc" would use to search "rect" for "count" points into
+ * "out_plan" without searching. Returns false when "sc" was not created with
+ * SearchEngine::Planned.
+ */
+extern "C" __declspec(dllexport) bool __stdcall explain_query(
+	const SearchContext* sc,
+	const Rect rect,
+	const int32_t count,
+	QueryPlan* out_plan);
+
+/*
+ * Copies the memory used to build the quad_tree of "sc" into "out_stats".
+ * Returns false when "sc" has no quad_tree, see SearchEngine::QuadTree and
+ * SearchEngine::Planned.
+ */
+extern "C" __declspec(dllexport) bool __stdcall build_memory(
+	const SearchContext* sc,
+	quad_tree::BuildStats* out_stats);
+
+/*
+ * Copies the leaf size and split policy auto tuning picked for "sc" into
+ * "out_tuning". Returns false when "sc" was not auto tuned, see
+ * SearchOptions::auto_tune.
+ */
+extern "C" __declspec(dllexport) bool __stdcall tuned_parameters(
+	const SearchContext* sc,
+	TuneResult* out_tuning);
+
 extern "C" __declspec(dllexport) SearchContext* __stdcall destroy(
 	SearchContext* sc
 );
@@ -0,0 +1,154 @@
+#include "priority_kd_tree.h"
+
+#include "query_helpers.h"
+#include "query_scratch.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+  inline std::size_t left_size(std::size_t size)
+  {
+    return (size - 1) / 2;
+  }
+}
+
+__stdcall priority_kd_tree::priority_kd_tree(
+  const Point* point_begin,
+  const Point* point_end)
+{
+  if (point_begin == nullptr || point_end == nullptr ||
+    point_begin == point_end) {
+    return;
+  }
+
+  std::size_t size = std::distance(point_begin, point_end);
+  if (size > (std::numeric_limits<uint32_t>::max)()) {
+    throw std::runtime_error(std::string(__FUNCTION__) +
+      " cannot index more than " +
+      std::to_string((std::numeric_limits<uint32_t>::max)()) + " points.");
+  }
+
+  nodes_.resize(size);
+  for (std::size_t i = 0; i < size; ++i) {
+    nodes_[i].point_ = point_begin[i];
+  }
+  build(0u, size);
+}
+
+void __stdcall priority_kd_tree::build(std::size_t begin, std::size_t size)
+{
+  // The subtree of size points starting at begin is rearranged in place:
+  // its lowest ranked point moves to begin, the median split of the rest
+  // puts the lower half right behind it and the upper half after that.
+  while (size > 0) {
+    auto first = nodes_.begin() + begin;
+    auto last = first + size;
+
+    Rect& bounds = first->bounds_;
+    bounds = Rect{ first->point_.x, first->point_.y, first->point_.x,
+      first->point_.y };
+    auto lowest = first;
+    for (auto it = first; it != last; ++it) {
+      bounds.lx = (std::min)(bounds.lx, it->point_.x);
+      bounds.ly = (std::min)(bounds.ly, it->point_.y);
+      bounds.hx = (std::max)(bounds.hx, it->point_.x);
+      bounds.hy = (std::max)(bounds.hy, it->point_.y);
+      if (it->point_.rank < lowest->point_.rank) {
+        lowest = it;
+      }
+    }
+    std::swap(first->point_, lowest->point_);
+
+    const std::size_t lower = left_size(size);
+    if (lower > 0) {
+      const bool split_x = (static_cast<double>(bounds.hx) - bounds.lx) >=
+        (static_cast<double>(bounds.hy) - bounds.ly);
+      std::nth_element(first + 1, first + 1 + lower, last,
+        [split_x](const node& lhs, const node& rhs)
+        {
+          return split_x ? lhs.point_.x < rhs.point_.x :
+            lhs.point_.y < rhs.point_.y;
+        });
+      build(begin + 1, lower);
+    }
+
+    // Loop on the upper half instead of recursing.
+    begin += 1 + lower;
+    size -= 1 + lower;
+  }
+}
+
+void __stdcall priority_kd_tree::query(
+  const Rect& query_rect,
+  const int32_t count,
+  int32_t& end_i,
+  Point* out_points) const
+{
+  if (nodes_.empty() ||
+    classify(query_rect, nodes_[0].bounds_) == Overlap::Disjoint) {
+    return;
+  }
+
+  struct ranked_node
+  {
+    int32_t rank_;
+    uint32_t index_;
+    uint32_t size_;
+    bool contained_;
+
+    bool operator>(const ranked_node& rhs) const
+    {
+      return rank_ > rhs.rank_;
+    }
+  };
+
+  top_k_buffer<int32_t> results(count, out_points, end_i);
+
+  scratch_heap<ranked_node> queue(thread_scratch<ranked_node>());
+  queue.push(ranked_node{ nodes_[0].point_.rank, 0u,
+    static_cast<uint32_t>(nodes_.size()),
+    classify(query_rect, nodes_[0].bounds_) == Overlap::Contained });
+
+  while (not queue.empty()) {
+    const ranked_node curr = queue.top();
+    if (curr.rank_ > results.threshold()) {
+      // Ranks only grow further down the heap.
+      break;
+    }
+    queue.pop();
+
+    const Point& point = nodes_[curr.index_].point_;
+    if (curr.contained_ || point_inside(point, query_rect)) {
+      results.offer(point);
+    }
+
+    const uint32_t lower = static_cast<uint32_t>(left_size(curr.size_));
+    const uint32_t children[2][2] = {
+      { curr.index_ + 1u, lower },
+      { curr.index_ + 1u + lower, curr.size_ - 1u - lower }
+    };
+    for (const auto& child : children) {
+      if (child[1] == 0u) {
+        continue;
+      }
+      const node& next = nodes_[child[0]];
+      Overlap overlap = curr.contained_ ? Overlap::Contained :
+        classify(query_rect, next.bounds_);
+      if (overlap != Overlap::Disjoint) {
+        queue.push(ranked_node{ next.point_.rank, child[0], child[1],
+          overlap == Overlap::Contained });
+      }
+    }
+  }
+  end_i = results.copy_to(out_points);
+}
+
+std::size_t __stdcall priority_kd_tree::size() const
+{
+  return nodes_.size();
+}
@@ -0,0 +1,78 @@
+#ifndef PRIORITY_KD_TREE_H
+#define PRIORITY_KD_TREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ipoint_search.h"
+
+/// <summary>
+/// A kd-tree whose nodes are heap ordered by rank, also known as a priority
+/// kd-tree. Every node holds the lowest ranked point of its subtree and the
+/// remaining points are split at the median of the wider axis between its
+/// two children. The tree is stored in pre order in a single array: the
+/// left child of the node at i with a subtree of n points is at i + 1 and
+/// holds (n - 1) / 2 points, the right child follows it. No child links are
+/// stored, every node is one point plus the bounds of its subtree.
+///
+/// A query pops nodes in rank order, so points come out already sorted and
+/// it stops after the count'th hit. Every node popped either yields a
+/// result or straddles an edge of the query rect, and a balanced kd-tree
+/// has O(sqrt(n)) nodes straddling a rect, so a query costs
+/// O(sqrt(n) + count log count) no matter how the ranks are distributed.
+/// </summary>
+class __declspec(dllexport) priority_kd_tree
+{
+private:
+  struct node
+  {
+    Rect bounds_;
+    Point point_;
+  };
+
+public:
+  /// <summary>
+  /// Constructor for a priority_kd_tree created from a contiguous block of
+  /// <see cref="Point"/> between the addresses stored by
+  /// <paramref name="point_begin"/> and <paramref name="point_end"/>.
+  /// O(n log n).
+  /// </summary>
+  /// <param name="point_begin">
+  /// The first Point in the array of points.
+  /// </param>
+  /// <param name="point_end">
+  /// One address past the end Point in the array of points.
+  /// </param>
+  __stdcall priority_kd_tree(
+    const Point* point_begin,
+    const Point* point_end);
+
+  /// <summary>
+  /// Fills <paramref name="out_points"/> with up to
+  /// <paramref name="count"/> points inside <paramref name="query_rect"/>
+  /// sorted by rank, see <see cref="quad_tree::query"/>.
+  /// </summary>
+  /// <param name="query_rect">The query_rect.</param>
+  /// <param name="count">The maximum number of points wanted.</param>
+  /// <param name="end_i">
+  /// Output parameter with the number of points inserted.
+  /// </param>
+  /// <param name="out_points">The sorted points by rank.</param>
+  void __stdcall query(const Rect& query_rect, const int32_t count,
+    int32_t& end_i, Point* out_points) const;
+
+  /// <summary>
+  /// The number of points stored within the tree.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall size() const;
+
+private:
+  void __stdcall build(std::size_t begin, std::size_t size);
+
+private:
+  std::vector<node> nodes_;
+};
+
+#endif
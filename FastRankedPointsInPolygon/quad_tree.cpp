@@ -1,7 +1,12 @@
 #include "quad_tree.h"
 
+#include "bit_kernels.h"
+#include "cpu_features.h"
 #include "io.h"
 #include "point_search.h"
+#include "query_helpers.h"
+#include "query_scratch.h"
+#include "radix_sort.h"
 
 #include <algorithm>
 #include <atomic>
@@ -10,108 +15,346 @@
 #include <deque>
 #include <fstream>
 #include <functional>
+#include <intrin.h>
 #include <iostream>
+#include <limits>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
 
-bool __stdcall intersect(
-  const DoubleRect& a,
-  const DoubleRect& b)
+constexpr uint32_t x_integer_space_ = 0xFFFFFFFF;
+constexpr uint32_t y_integer_space_ = 0xFFFFFFFF;
+
+namespace
 {
-  bool ret = true;
-  ret &= a.lx <= b.hx;
-  ret &= a.hx >= b.lx;
-  ret &= a.ly <= b.hy;
-  ret &= a.hy >= b.ly;
-  return ret;
+  // Maps a full 64 bit morton code to its quad_key at depth, keeping the
+  // top bit from barrel rolling into the depth bit.
+  inline uint64_t quad_key_from_morton(uint64_t morton, uint8_t depth)
+  {
+    bool chop_bit_to_prevent_barrel_roll = morton & 0x8000000000000000;
+    if (chop_bit_to_prevent_barrel_roll) {
+      morton &= (~0x8000000000000000); // To prevent barrel rolling
+    }
+
+    uint64_t shift = (64ull - static_cast<uint64_t>(depth * 2ull));
+    if (shift == 64) {
+      shift = 63; // On x64 the next line will fail to shift mith msvc.
+    }
+    uint64_t morton_shifted_by_depth = (morton >> shift);
+    uint64_t depth_bit = (0x1ull << (2 * depth));
+
+    uint64_t morton_shifted_with_depth_bit = morton_shifted_by_depth |
+      depth_bit;
+
+    if (chop_bit_to_prevent_barrel_roll && depth != 0) {
+      uint64_t y_bit_back_in = (0x1ull << (depth * 2ull - 1ull));
+      morton_shifted_with_depth_bit |= y_bit_back_in;
+    }
+    return morton_shifted_with_depth_bit;
+  }
+
+  inline const Point& point_at(const Point* points, std::size_t i)
+  {
+    return points[i];
+  }
+
+  inline const Point& point_at(const Point* const* points, std::size_t i)
+  {
+    return *points[i];
+  }
+
+  // The bounds of the count points of points, floored and ceiled to whole
+  // numbers, see quad_tree::compute_bounds.
+  template <typename Points_t>
+  DoubleRect bounds_of(Points_t points, std::size_t count)
+  {
+    float max_y = -(std::numeric_limits<float>::max)();
+    float min_y = +(std::numeric_limits<float>::max)();
+    float max_x = -(std::numeric_limits<float>::max)();
+    float min_x = +(std::numeric_limits<float>::max)();
+
+    for (std::size_t i = 0; i < count; ++i) {
+      const Point& p = point_at(points, i);
+      if (p.x < min_x) min_x = p.x;
+      if (p.x > max_x) max_x = p.x;
+      if (p.y < min_y) min_y = p.y;
+      if (p.y > max_y) max_y = p.y;
+    }
+
+    return { std::floor(min_x), std::floor(min_y),
+      std::ceil(max_x), std::ceil(max_y) };
+  }
+
+  constexpr std::size_t KEY_BATCH_SIZE = 4u;
+
+  // Normalizes KEY_BATCH_SIZE points into the 32 bit integer space the
+  // same way compute_quad_key does: the division is kept rather than
+  // multiplying by a reciprocal so every key rounds identically.
+  template <typename Points_t>
+  inline void normalize_avx2(
+    Points_t points,
+    std::size_t i,
+    const DoubleRect& bounds,
+    uint32_t* out_x,
+    uint32_t* out_y)
+  {
+    const Point& p0 = point_at(points, i + 0u);
+    const Point& p1 = point_at(points, i + 1u);
+    const Point& p2 = point_at(points, i + 2u);
+    const Point& p3 = point_at(points, i + 3u);
+    const __m256d px = _mm256_cvtps_pd(_mm_set_ps(p3.x, p2.x, p1.x, p0.x));
+    const __m256d py = _mm256_cvtps_pd(_mm_set_ps(p3.y, p2.y, p1.y, p0.y));
+
+    const __m256d lx = _mm256_set1_pd(static_cast<double>(bounds.lx));
+    const __m256d ly = _mm256_set1_pd(static_cast<double>(bounds.ly));
+    const __m256d domain = _mm256_set1_pd(static_cast<double>(bounds.hx) -
+      static_cast<double>(bounds.lx));
+    const __m256d range = _mm256_set1_pd(static_cast<double>(bounds.hy) -
+      static_cast<double>(bounds.ly));
+    const __m256d x_space = _mm256_set1_pd(x_integer_space_);
+    const __m256d y_space = _mm256_set1_pd(y_integer_space_);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d max_32_bit_uint = _mm256_set1_pd(
+      (std::numeric_limits<uint32_t>::max)());
+    // There is no unsigned conversion below AVX-512, so whole values are
+    // biased into the signed range and the bias is flipped back after.
+    const __m256d bias = _mm256_set1_pd(2147483648.0);
+    const __m128i sign = _mm_set1_epi32(static_cast<int32_t>(0x80000000u));
+
+    __m256d sx = _mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(px, lx), domain),
+      x_space);
+    __m256d sy = _mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(py, ly), range),
+      y_space);
+    sx = _mm256_floor_pd(_mm256_min_pd(_mm256_max_pd(sx, zero),
+      max_32_bit_uint));
+    sy = _mm256_floor_pd(_mm256_min_pd(_mm256_max_pd(sy, zero),
+      max_32_bit_uint));
+    const __m128i ix = _mm_xor_si128(
+      _mm256_cvttpd_epi32(_mm256_sub_pd(sx, bias)), sign);
+    const __m128i iy = _mm_xor_si128(
+      _mm256_cvttpd_epi32(_mm256_sub_pd(sy, bias)), sign);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out_x), ix);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out_y), iy);
+  }
+
+  inline uint64_t interleave_bmi2(uint32_t x, uint32_t y)
+  {
+    return _pdep_u64(x, 0x5555555555555555ull) |
+      _pdep_u64(y, 0xAAAAAAAAAAAAAAAAull);
+  }
+
+  inline uint64_t interleave_scalar(uint32_t x, uint32_t y)
+  {
+    return quad_tree::spread_by_1_bit(x) |
+      (quad_tree::spread_by_1_bit(y) << 1);
+  }
+
+  template <typename Points_t>
+  void compute_quad_keys_batched(
+    Points_t points,
+    std::size_t count,
+    uint8_t depth,
+    const DoubleRect& bounds,
+    uint64_t* out_keys)
+  {
+    if (depth > quad_tree::max_depth()) {
+      throw std::runtime_error(
+        std::to_string(depth) + " must be less than or equal to " +
+        std::to_string(quad_tree::max_depth()));
+    }
+
+    const cpu_features& cpu = cpu_features::get();
+    std::size_t i = 0u;
+    if (cpu.avx2_) {
+      // pdep is inlined here rather than called through spread_bits32.
+      const bool bmi2 = morton_kernel() == MortonKernel::Bmi2;
+      uint32_t x[KEY_BATCH_SIZE];
+      uint32_t y[KEY_BATCH_SIZE];
+      for (; i + KEY_BATCH_SIZE <= count; i += KEY_BATCH_SIZE) {
+        normalize_avx2(points, i, bounds, x, y);
+        for (std::size_t j = 0u; j < KEY_BATCH_SIZE; ++j) {
+          const uint64_t morton = bmi2 ? interleave_bmi2(x[j], y[j]) :
+            interleave_scalar(x[j], y[j]);
+          out_keys[i + j] = quad_key_from_morton(morton, depth);
+        }
+      }
+    }
+    for (; i < count; ++i) {
+      out_keys[i] = quad_tree::compute_quad_key(point_at(points, i), depth,
+        bounds);
+    }
+  }
+
+  typedef std::vector<Point*>::iterator PointIter_t;
+
+  // Orders [begin, end) so the lower half of coord comes first and returns
+  // where the upper half starts.
+  template <typename Coord_t>
+  PointIter_t split_at_median(PointIter_t begin, PointIter_t end,
+    Coord_t coord)
+  {
+    PointIter_t middle = begin + std::distance(begin, end) / 2;
+    std::nth_element(begin, middle, end,
+      [&](const Point* lhs, const Point* rhs)
+      {
+        return coord(lhs) < coord(rhs);
+      });
+    return middle;
+  }
+
+  struct SplitBin
+  {
+    std::size_t count;
+    float lo_a;
+    float hi_a;
+    float lo_b;
+    float hi_b;
+  };
+
+  inline void grow_bin(SplitBin& bin, const SplitBin& other)
+  {
+    bin.count += other.count;
+    bin.lo_a = (std::min)(bin.lo_a, other.lo_a);
+    bin.hi_a = (std::max)(bin.hi_a, other.hi_a);
+    bin.lo_b = (std::min)(bin.lo_b, other.lo_b);
+    bin.hi_b = (std::max)(bin.hi_b, other.hi_b);
+  }
+
+  inline double split_cost(const SplitBin& bin)
+  {
+    // Half perimeter rather than area so slivers of collinear points still
+    // cost something.
+    return (static_cast<double>(bin.hi_a) - bin.lo_a +
+      static_cast<double>(bin.hi_b) - bin.lo_b) * bin.count;
+  }
+
+  // Cuts [begin, end) along coord at the bin boundary minimizing the summed
+  // split_cost of both sides, other being the second axis of the bounds.
+  // Falls back to the median when every point shares one bin.
+  template <typename Coord_t, typename Other_t>
+  PointIter_t split_by_cost(PointIter_t begin, PointIter_t end,
+    Coord_t coord, Other_t other)
+  {
+    constexpr std::size_t BINS = quad_tree::SPLIT_BINS;
+    if (std::distance(begin, end) < 2) {
+      return split_at_median(begin, end, coord);
+    }
+
+    float lo = +(std::numeric_limits<float>::max)();
+    float hi = -(std::numeric_limits<float>::max)();
+    for (PointIter_t it = begin; it != end; ++it) {
+      lo = (std::min)(lo, coord(*it));
+      hi = (std::max)(hi, coord(*it));
+    }
+    const double scale = static_cast<double>(BINS) /
+      (static_cast<double>(hi) - static_cast<double>(lo));
+    if (!(hi > lo) || !std::isfinite(scale)) {
+      return split_at_median(begin, end, coord);
+    }
+    auto bin_of = [&](const Point* p)
+    {
+      return (std::min)(BINS - 1u, static_cast<std::size_t>(
+        (static_cast<double>(coord(p)) - lo) * scale));
+    };
+
+    const SplitBin empty = { 0u,
+      +(std::numeric_limits<float>::max)(),
+      -(std::numeric_limits<float>::max)(),
+      +(std::numeric_limits<float>::max)(),
+      -(std::numeric_limits<float>::max)() };
+    SplitBin bins[BINS];
+    std::fill(std::begin(bins), std::end(bins), empty);
+    for (PointIter_t it = begin; it != end; ++it) {
+      const SplitBin point = { 1u, coord(*it), coord(*it), other(*it),
+        other(*it) };
+      grow_bin(bins[bin_of(*it)], point);
+    }
+
+    SplitBin above[BINS];
+    above[BINS - 1u] = bins[BINS - 1u];
+    for (std::size_t i = BINS - 1u; i-- > 0u;) {
+      above[i] = above[i + 1u];
+      grow_bin(above[i], bins[i]);
+    }
+    std::size_t best = 0u;
+    double best_cost = (std::numeric_limits<double>::max)();
+    SplitBin below = empty;
+    for (std::size_t i = 1u; i < BINS; ++i) {
+      grow_bin(below, bins[i - 1u]);
+      if (below.count == 0u || above[i].count == 0u) {
+        continue;
+      }
+      const double cost = split_cost(below) + split_cost(above[i]);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best = i;
+      }
+    }
+    return std::partition(begin, end,
+      [&](const Point* p)
+      {
+        return bin_of(p) < best;
+      });
+  }
 }
 
-bool __stdcall intersect_point(
-  const Point& a,
-  const DoubleRect& b)
+// The last two bits of quad_tree::compute_quad_key(p, depth + 1, bounds),
+// the quadrant of its parent p falls in, without interleaving the rest.
+inline uint64_t __stdcall child_quadrant(
+  const Point& p,
+  uint8_t depth,
+  const DoubleRect& bounds)
 {
-  bool ret = true;
-  ret &= a.x >= b.lx;
-  ret &= a.x <= b.hx;
-  ret &= a.y >= b.ly;
-  ret &= a.y <= b.hy;
-  return ret;
+  double percent_x = (static_cast<double>(p.x)
+    - static_cast<double>(bounds.lx)) /
+    (static_cast<double>(bounds.hx) - static_cast<double>(bounds.lx));
+  double percent_y = (static_cast<double>(p.y)
+    - static_cast<double>(bounds.ly)) /
+    (static_cast<double>(bounds.hy) - static_cast<double>(bounds.ly));
+
+  constexpr uint64_t max_32_bit_uint = (std::numeric_limits<uint32_t>::max)();
+  uint64_t percent_x_i = (std::min)(
+    static_cast<uint64_t>(percent_x * x_integer_space_), max_32_bit_uint);
+  uint64_t percent_y_i = (std::min)(
+    static_cast<uint64_t>(percent_y * y_integer_space_), max_32_bit_uint);
+
+  const uint64_t bit = 31ull - depth;
+  return ((percent_x_i >> bit) & 0x1ull) |
+    (((percent_y_i >> bit) & 0x1ull) << 1);
 }
 
-constexpr uint32_t x_integer_space_ = 0xFFFFFFFF;
-constexpr uint32_t y_integer_space_ = 0xFFFFFFFF;
-
 uint64_t __stdcall only_msb64_on(register uint64_t x)
 {
-  x |= (x >> 1);
-  x |= (x >> 2);
-  x |= (x >> 4);
-  x |= (x >> 8);
-  x |= (x >> 16);
-  x |= (x >> 32);
-  return x & ~(x >> 1ull);
+  return x == 0ull ? 0ull : (0x1ull << msb_index64(x));
 }
 
 int8_t __stdcall quad_tree::msb64(register uint64_t x)
 {
-  uint64_t depth = max_depth();
-
   uint64_t max_bit = (1ull << (2ull * max_depth()));
   uint64_t max_val = max_bit | (max_bit - 1);
 
-  x = only_msb64_on(x);
-  if (x & 0x0000000000000001ull) {
-    depth = 0ull;
-  } else if (x & 0x1000000000000000ull) {
+  int32_t depth = msb_index64(x);
+  if (depth == 60) {
     depth = max_depth();
   } else if (x > max_val) {
     throw std::runtime_error("Invalid key provided to msb64.");
-  } else {
-    uint64_t mask = 0x0000000080000000ull;
-    uint64_t shift = 32ull;
-    depth = 31ull;
-    while (shift != 0) {
-      shift /= 2;
-      if (x > mask) {
-        mask <<= shift;
-        depth += shift;
-      } else if (x < mask) {
-        mask >>= shift;
-        depth -= shift;
-      } else {
-        break;
-      }
-    }
+  } else if (depth < 0) {
+    depth = 0;
   }
   return static_cast<int8_t>(depth);
 }
 
 uint64_t __stdcall quad_tree::spread_by_1_bit(int64_t x)
 {
-  x &= 0x00000000ffffffffull;
-  x = (x | (x << 16)) & 0x0000ffff0000ffffull;
-  x = (x | (x << 8)) & 0x00ff00ff00ff00ffull;
-  x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0full;
-  x = (x | (x << 2)) & 0x3333333333333333ull;
-  x = (x | (x << 1)) & 0x5555555555555555ull;
-
-  return x;
+  return spread_bits32(static_cast<uint32_t>(x));
 }
 
 int64_t __stdcall quad_tree::compact_by_1_bit(int64_t x)
 {
-  x &= 0x5555555555555555ull;
-  x = (x | (x >> 1)) & 0x3333333333333333ull;
-  x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0full;
-  x = (x | (x >> 4)) & 0x00ff00ff00ff00ffull;
-  x = (x | (x >> 8)) & 0x0000ffff0000ffffull;
-  x = (x | (x >> 16)) & 0x00000000ffffffffull;
-
-  return x;
+  return compact_bits64(static_cast<uint64_t>(x));
 }
 
 uint8_t __stdcall quad_tree::max_depth()
@@ -153,27 +396,27 @@ uint64_t __stdcall quad_tree::compute_quad_key(
   uint64_t ybits = spread_by_1_bit(percent_y_i);
   uint64_t ybits_shifted = (ybits << 1);
 
-  uint64_t morton = xbits | ybits_shifted;
-  bool chop_bit_to_prevent_barrel_roll = morton & 0x8000000000000000;
-  if (chop_bit_to_prevent_barrel_roll) {
-    morton &= (~0x8000000000000000); // To prevent barrel rolling
-  }
-
-  uint64_t shift = (64ull - static_cast<uint64_t>(depth * 2ull));
-  if (shift == 64) {
-    shift = 63; // On x64 the next line will fail to shift mith msvc.
-  }
-  uint64_t morton_shifted_by_depth = (morton >> shift);
-  uint64_t depth_bit = (0x1ull << (2 * depth));
+  return quad_key_from_morton(xbits | ybits_shifted, depth);
+}
 
-  uint64_t morton_shifted_with_depth_bit = morton_shifted_by_depth |
-    depth_bit;
+void __stdcall quad_tree::compute_quad_keys(
+  const Point* points,
+  std::size_t count,
+  uint8_t depth,
+  const DoubleRect& bounds,
+  uint64_t* out_keys)
+{
+  compute_quad_keys_batched(points, count, depth, bounds, out_keys);
+}
 
-  if (chop_bit_to_prevent_barrel_roll && depth != 0) {
-    uint64_t y_bit_back_in = (0x1ull << (depth * 2ull - 1ull));
-    morton_shifted_with_depth_bit |= y_bit_back_in;
-  }
-  return morton_shifted_with_depth_bit;
+void __stdcall quad_tree::compute_quad_keys(
+  const Point* const* points,
+  std::size_t count,
+  uint8_t depth,
+  const DoubleRect& bounds,
+  uint64_t* out_keys)
+{
+  compute_quad_keys_batched(points, count, depth, bounds, out_keys);
 }
 
 uint64_t __stdcall quad_tree::min_id(uint8_t depth)
@@ -210,7 +453,7 @@ void __stdcall quad_tree::compute_children(
   if (!is_valid(parent)) {
     throw std::runtime_error("Invalid child of " + std::to_string(parent));
   }
-  else if (parent >= max_id(max_depth() - 1)) {
+  else if (parent >= min_id(max_depth())) {
     throw std::runtime_error("You have reached the maximum depth.");
   }
   for (std::size_t i : {0, 1, 2, 3}) {
@@ -315,9 +558,14 @@ uint32_t __stdcall quad_tree::step_size_at_depth(uint8_t depth)
   return x_integer_space_ >> depth;
 }
 
-quad_tree::node::node(uint64_t quad_key, const DoubleRect& point_bounds) :
+quad_tree::node::node(uint64_t quad_key, const DoubleRect& point_bounds,
+  arena& owner) :
   quad_key_(quad_key),
-  point_bounds_(point_bounds)
+  points_(arena_allocator<Point>(owner)),
+  point_bounds_(point_bounds),
+  min_rank_((std::numeric_limits<int32_t>::max)()),
+  point_count_(0),
+  top_k_(arena_allocator<Point>(owner))
 {
   children_[0] = nullptr;
   children_[1] = nullptr;
@@ -325,11 +573,6 @@ quad_tree::node::node(uint64_t quad_key, const DoubleRect& point_bounds) :
   children_[3] = nullptr;
 }
 
-quad_tree::node::~node()
-{
-  points_.clear();
-}
-
 void __stdcall quad_tree::node::set_data(
   std::vector<Point*>::iterator begin,
   std::vector<Point*>::iterator end)
@@ -348,6 +591,10 @@ void __stdcall quad_tree::node::set_data(
     {
       return lhs.rank < rhs.rank;
     });
+  if (!points_.empty()) {
+    min_rank_ = points_.front().rank;
+  }
+  point_count_ = points_.size();
 }
 
 void __stdcall quad_tree::node::set_child(const ChildId id, node* child)
@@ -359,9 +606,15 @@ __stdcall quad_tree::quad_tree(
   const Point* point_begin,
   const Point* point_end,
   const std::size_t min_block_size,
-  const std::size_t max_block_size) :
+  const std::size_t max_block_size,
+  const BuildOptions& options) :
   root_(nullptr),
-  global_bounds_({})
+  global_bounds_({}),
+  query_mode_(QueryMode::BestFirst),
+  prefetch_distance_(PREFETCH_DISTANCE),
+  options_(options),
+  build_pool_(nullptr),
+  build_stats_({})
 {
   if (point_begin == nullptr || point_end == nullptr) {
     return;
@@ -370,26 +623,36 @@ __stdcall quad_tree::quad_tree(
   Point* citer = const_cast<Point*>(point_begin);
   std::vector<Point*> points;
   points_to_vector(point_begin, point_end, points, *this);
-  create(points.begin(), points.end(), min_block_size, max_block_size);
+  if (!points.empty()) {
+    create(points.begin(), points.end(), min_block_size, max_block_size);
+  }
 }
 
 __stdcall quad_tree::quad_tree(
   std::vector<Point*>::iterator begin,
   std::vector<Point*>::iterator end,
   const std::size_t min_block_size,
-  const std::size_t max_block_size) :
+  const std::size_t max_block_size,
+  const BuildOptions& options) :
   root_(nullptr),
-  global_bounds_({})
+  global_bounds_({}),
+  query_mode_(QueryMode::BestFirst),
+  prefetch_distance_(PREFETCH_DISTANCE),
+  options_(options),
+  build_pool_(nullptr),
+  build_stats_({})
 {
   if (begin == end) {
     return;
   }
-  create(begin, end, min_block_size, max_block_size);
+  // The build partitions its pointers in place, leave the caller's alone.
+  std::vector<Point*> points(begin, end);
+  create(points.begin(), points.end(), min_block_size, max_block_size);
 }
 
 __stdcall quad_tree::~quad_tree()
 {
-  destroy_tree(root_);
+  destroy_tree();
 }
 
 const DoubleRect& __stdcall quad_tree::global_bounds() const
@@ -397,96 +660,533 @@ const DoubleRect& __stdcall quad_tree::global_bounds() const
   return global_bounds_;
 }
 
-inline bool in_place_sort_points(
+void __stdcall quad_tree::query(
+  const Rect& query_rect,
+  const int32_t count,
   int32_t& end_i,
-  const int32_t& count,
-  Point* end_point,
-  const Point& point,
   Point* out_points)
 {
-
+  // The counts callers ask for nearly always, each with its own copy of the
+  // traversal so the result buffer bounds are constants.
+  switch (count) {
+  case 10:
+    query_with_count(query_rect, FixedCount<10>(), end_i, out_points);
+    break;
+  case 20:
+    query_with_count(query_rect, FixedCount<20>(), end_i, out_points);
+    break;
+  case 50:
+    query_with_count(query_rect, FixedCount<50>(), end_i, out_points);
+    break;
+  default:
+    query_with_count(query_rect, count, end_i, out_points);
+    break;
+  }
 }
 
-void __stdcall quad_tree::query(
+template <typename Count_t>
+void __stdcall quad_tree::query_with_count(
   const Rect& query_rect,
-  const int32_t count,
+  const Count_t count,
   int32_t& end_i,
   Point* out_points)
 {
-  DoubleRect bounds = {
-    query_rect.lx,
-    query_rect.ly,
-    query_rect.hx,
-    query_rect.hy
-  };
+  top_k_buffer<Count_t> results(count, out_points, end_i);
+
+  if (!compact_nodes_.empty()) {
+    query_compact(query_rect, results);
+  } else if (root_ != nullptr) {
+    DoubleRect bounds = {
+      query_rect.lx,
+      query_rect.ly,
+      query_rect.hx,
+      query_rect.hy
+    };
 
-  std::queue<quad_tree::node*> queue;
-  queue.push(root_);
+    switch (query_mode_) {
+    case QueryMode::BreadthFirst:
+      query_breadth_first(bounds, results);
+      break;
+    case QueryMode::BestFirst:
+      query_best_first(bounds, results);
+      break;
+    case QueryMode::RankMerge:
+      query_rank_merge(bounds, results);
+      break;
+    }
+  }
 
-  Point* end_point = nullptr;
+  // The outliers are rank sorted, the scan stops at the first one that
+  // cannot displace a result.
+  if (!outliers_.empty()) {
+    insert_leaf_points(outliers_.data(), outliers_.size(), query_rect,
+      results);
+  }
+  end_i = results.copy_to(out_points);
+}
+
+void __stdcall quad_tree::set_query_mode(QueryMode mode)
+{
+  query_mode_ = mode;
+}
+
+quad_tree::QueryMode __stdcall quad_tree::query_mode() const
+{
+  return query_mode_;
+}
+
+void __stdcall quad_tree::set_prefetch_distance(std::size_t distance)
+{
+  prefetch_distance_ = distance;
+}
+
+std::size_t __stdcall quad_tree::prefetch_distance() const
+{
+  return prefetch_distance_;
+}
+
+bool __stdcall quad_tree::is_compact() const
+{
+  return !compact_nodes_.empty();
+}
+
+/// <summary>
+/// Narrows <paramref name="value"/> to the largest float not above it.
+/// </summary>
+inline float round_down(double value)
+{
+  float ret = static_cast<float>(value);
+  if (static_cast<double>(ret) > value) {
+    ret = std::nextafter(ret, -(std::numeric_limits<float>::infinity)());
+  }
+  return ret;
+}
+
+/// <summary>
+/// Narrows <paramref name="value"/> to the smallest float not below it.
+/// </summary>
+inline float round_up(double value)
+{
+  float ret = static_cast<float>(value);
+  if (static_cast<double>(ret) < value) {
+    ret = std::nextafter(ret, +(std::numeric_limits<float>::infinity)());
+  }
+  return ret;
+}
+
+std::size_t __stdcall quad_tree::build_compact()
+{
+  if (root_ == nullptr) {
+    return 0u;
+  }
+
+  // Level order keeps the top of the tree in the first few cache lines.
+  // The order is taken first so every array can be reserved at its final
+  // size and the copy never reallocates.
+  std::vector<node*> order(1, root_);
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    for (node* child : order[i]->children_) {
+      if (child != nullptr) {
+        order.push_back(child);
+      }
+    }
+  }
+  std::size_t pool_size = 0;
+  std::size_t soa_size = 0;
+  for (const node* curr : order) {
+    pool_size += curr->top_k_.size();
+    if (options_.leaf_layout == LeafLayout::Packed) {
+      pool_size += curr->points_.size();
+    } else if (!curr->points_.empty()) {
+      soa_size = (soa_size + soa_points::LANE_ALIGNMENT - 1) /
+        soa_points::LANE_ALIGNMENT * soa_points::LANE_ALIGNMENT +
+        curr->points_.size();
+    }
+  }
+  compact_nodes_.reserve(order.size());
+  point_pool_.reserve(pool_size);
+  if (options_.leaf_layout != LeafLayout::Packed) {
+    leaf_soa_.reserve((soa_size + soa_points::LANE_ALIGNMENT - 1) /
+      soa_points::LANE_ALIGNMENT * soa_points::LANE_ALIGNMENT +
+      soa_points::BLOCK_SIZE,
+      options_.leaf_layout == LeafLayout::Quantized);
+  }
+
+  uint32_t next_child = 1u;
+  for (const node* curr : order) {
+    compact_node compact = {};
+    compact.point_bounds_ = Rect{
+      round_down(curr->point_bounds_.lx),
+      round_down(curr->point_bounds_.ly),
+      round_up(curr->point_bounds_.hx),
+      round_up(curr->point_bounds_.hy)
+    };
+    for (std::size_t c = 0; c < 4; ++c) {
+      compact.children_[c] = curr->children_[c] != nullptr ?
+        next_child++ : NO_CHILD;
+    }
+    compact.leaf_length_ = static_cast<uint32_t>(curr->points_.size());
+    if (options_.leaf_layout == LeafLayout::Soa) {
+      std::size_t offset = curr->points_.empty() ? 0u :
+        leaf_soa_.append(curr->points_.data(), curr->points_.size());
+      compact.leaf_offset_ = static_cast<uint32_t>(offset);
+    } else if (options_.leaf_layout == LeafLayout::Quantized) {
+      std::size_t offset = curr->points_.empty() ? 0u :
+        leaf_soa_.append_quantized(curr->points_.data(),
+          curr->points_.size(), compact.point_bounds_);
+      compact.leaf_offset_ = static_cast<uint32_t>(offset);
+    } else {
+      compact.leaf_offset_ = static_cast<uint32_t>(point_pool_.size());
+      point_pool_.insert(point_pool_.end(), curr->points_.begin(),
+        curr->points_.end());
+    }
+    compact.top_k_offset_ = static_cast<uint32_t>(point_pool_.size());
+    compact.top_k_length_ = static_cast<uint32_t>(curr->top_k_.size());
+    point_pool_.insert(point_pool_.end(), curr->top_k_.begin(),
+      curr->top_k_.end());
+    compact.min_rank_ = curr->min_rank_;
+    compact.point_count_ = static_cast<uint32_t>(curr->point_count_);
+    compact.quad_key_ = curr->quad_key_;
+    compact_nodes_.push_back(compact);
+
+    if (point_pool_.size() > (std::numeric_limits<uint32_t>::max)() ||
+      leaf_soa_.size() > (std::numeric_limits<uint32_t>::max)()) {
+      throw std::runtime_error(std::string(__FUNCTION__) +
+        " cannot address more than " +
+        std::to_string((std::numeric_limits<uint32_t>::max)()) +
+        " pooled points.");
+    }
+  }
+  const std::size_t peak_bytes = order.capacity() * sizeof(node*) +
+    compact_bytes();
+  compact_nodes_.shrink_to_fit();
+  point_pool_.shrink_to_fit();
+  if (options_.leaf_layout != LeafLayout::Packed) {
+    leaf_soa_.finish();
+  }
+
+  destroy_tree();
+  return peak_bytes;
+}
+
+template <typename Count_t>
+void __stdcall quad_tree::query_compact(
+  const Rect& bounds,
+  top_k_buffer<Count_t>& results) const
+{
+  typedef std::pair<int32_t, uint32_t> RankedNode_t;
+  scratch_heap<RankedNode_t> queue(thread_scratch<RankedNode_t>());
+  queue.push(std::make_pair(compact_nodes_[0].min_rank_, 0u));
+
+  const Point* pool = point_pool_.data();
   while (not queue.empty()) {
-    quad_tree::node* curr = queue.front();
+    const compact_node& curr = compact_nodes_[queue.top().second];
+    if (queue.top().first > results.threshold()) {
+      // Every node left in the queue only holds higher ranks.
+      break;
+    }
     queue.pop();
-    if (intersect(bounds, curr->point_bounds_) && !curr->points_.empty()) {
-      std::size_t size = curr->points_.size();
-      for (std::size_t i = 0; i < size; ++i) {
-        Point& point = curr->points_[i];
-        if (intersect_point(point, bounds)) {
-          if (end_i == count && end_point && point.rank > end_point->rank) {
-            // The rest of the points in this node do not need to be
-            // considered.
-            break;
-          } else {
-            auto it = std::lower_bound(out_points, out_points + end_i, point);
-            std::int32_t i = std::distance(out_points, it);
-            Point tmp = out_points[i];
-            out_points[i] = point;
-            while (i <= end_i) {
-              ++i;
-              if (i < count) {
-                std::swap(tmp, out_points[i]);
-              }
-            }
-            if (i <= count && i > end_i) {
-              end_i = i;
-              end_point = &out_points[(std::min)(end_i, count - 1)];
-            }
+    Overlap overlap = classify(bounds, curr.point_bounds_);
+    if (overlap == Overlap::Disjoint) {
+      continue;
+    } else if (curr.leaf_length_ != 0 && !leaf_soa_.empty()) {
+      if (overlap == Overlap::Contained) {
+        insert_contained_points(leaf_soa_, curr.leaf_offset_,
+          curr.leaf_length_, results);
+      } else if (leaf_soa_.is_quantized()) {
+        insert_quantized_leaf_points(leaf_soa_, curr.leaf_offset_,
+          curr.leaf_length_, curr.point_bounds_, bounds, results);
+      } else {
+        insert_leaf_points(leaf_soa_, curr.leaf_offset_, curr.leaf_length_,
+          bounds, results);
+      }
+    } else if (curr.leaf_length_ != 0) {
+      if (overlap == Overlap::Contained) {
+        insert_contained_points(pool + curr.leaf_offset_, curr.leaf_length_,
+          results);
+      } else {
+        insert_leaf_points(pool + curr.leaf_offset_, curr.leaf_length_,
+          bounds, results);
+      }
+    } else if (overlap == Overlap::Contained && curr.top_k_length_ != 0 &&
+      (curr.top_k_length_ == curr.point_count_ ||
+        static_cast<uint32_t>(results.capacity()) <= curr.top_k_length_)) {
+      insert_contained_points(pool + curr.top_k_offset_, curr.top_k_length_,
+        results);
+    } else {
+      // Request every child before reading any, so their misses overlap.
+      if (prefetch_distance_ != 0) {
+        for (uint32_t child : curr.children_) {
+          if (child != NO_CHILD) {
+            prefetch(&compact_nodes_[child], sizeof(compact_node));
+          }
+        }
+      }
+      for (uint32_t child : curr.children_) {
+        if (child != NO_CHILD) {
+          const compact_node& next = compact_nodes_[child];
+          // The node is read for its rank here, so its leaf points are
+          // requested once now rather than when it comes up.
+          if (prefetch_distance_ != 0 &&
+            next.min_rank_ <= results.threshold()) {
+            prefetch_leaf(next);
           }
+          queue.push(std::make_pair(next.min_rank_, child));
         }
       }
+    }
+  }
+}
+
+template <typename Count_t>
+bool __stdcall quad_tree::visit_node(
+  const node* curr,
+  const Overlap overlap,
+  const DoubleRect& bounds,
+  top_k_buffer<Count_t>& results) const
+{
+  bool ret = true;
+  if (!curr->points_.empty()) {
+    if (overlap == Overlap::Contained) {
+      insert_contained_points(curr->points_.data(), curr->points_.size(),
+        results);
     } else {
+      insert_leaf_points(curr->points_.data(), curr->points_.size(),
+        bounds, results);
+    }
+  } else if (overlap == Overlap::Contained && !curr->top_k_.empty() &&
+    (curr->top_k_.size() == curr->point_count_ ||
+      static_cast<std::size_t>(results.capacity()) <=
+        curr->top_k_.size())) {
+    // The sample answers the subtree when it holds every point underneath
+    // or at least as many as are being asked for.
+    insert_contained_points(curr->top_k_.data(), curr->top_k_.size(),
+      results);
+  } else {
+    ret = false;
+  }
+  return ret;
+}
+
+template <typename Count_t>
+void __stdcall quad_tree::query_breadth_first(
+  const DoubleRect& bounds,
+  top_k_buffer<Count_t>& results)
+{
+  // Visited nodes are left behind the head rather than popped, the
+  // scratch vector only grows to the nodes one query reaches.
+  std::vector<quad_tree::node*>& queue = thread_scratch<quad_tree::node*>();
+  queue.push_back(root_);
+
+  for (std::size_t head = 0; head < queue.size(); ++head) {
+    quad_tree::node* curr = queue[head];
+    if (prefetch_distance_ != 0 && head + prefetch_distance_ < queue.size()) {
+      prefetch_leaf(queue[head + prefetch_distance_]);
+    }
+    Overlap overlap = classify(bounds, curr->point_bounds_);
+    if (overlap == Overlap::Disjoint ||
+      visit_node(curr, overlap, bounds, results)) {
+      continue;
+    }
+    for (std::size_t i = 0; i < 4; ++i) {
+      quad_tree::node* child = curr->children_[i];
+      if (child != nullptr) {
+        if (prefetch_distance_ != 0) {
+          prefetch(child, sizeof(node));
+        }
+        queue.push_back(child);
+      }
+    }
+  }
+}
+
+template <typename Count_t>
+void __stdcall quad_tree::query_best_first(
+  const DoubleRect& bounds,
+  top_k_buffer<Count_t>& results)
+{
+  typedef std::pair<int32_t, quad_tree::node*> RankedNode_t;
+  scratch_heap<RankedNode_t> queue(thread_scratch<RankedNode_t>());
+  queue.push(std::make_pair(root_->min_rank_, root_));
+
+  while (not queue.empty()) {
+    quad_tree::node* curr = queue.top().second;
+    if (queue.top().first > results.threshold()) {
+      // Every node left in the queue only holds higher ranks.
+      break;
+    }
+    queue.pop();
+    Overlap overlap = classify(bounds, curr->point_bounds_);
+    if (overlap == Overlap::Disjoint ||
+      visit_node(curr, overlap, bounds, results)) {
+      continue;
+    }
+    // Request every child before reading any, so their misses overlap.
+    if (prefetch_distance_ != 0) {
       for (std::size_t i = 0; i < 4; ++i) {
-        quad_tree::node* child = curr->children_[i];
-        if (child != nullptr && intersect(child->point_bounds_, bounds)) {
-          queue.push(child);
+        if (curr->children_[i] != nullptr) {
+          prefetch(curr->children_[i], sizeof(node));
+        }
+      }
+    }
+    for (std::size_t i = 0; i < 4; ++i) {
+      quad_tree::node* child = curr->children_[i];
+      if (child != nullptr) {
+        // The node is read for its rank here, so its leaf points are
+        // requested once now rather than when it comes up.
+        if (prefetch_distance_ != 0 &&
+          child->min_rank_ <= results.threshold()) {
+          prefetch_leaf(child);
         }
+        queue.push(std::make_pair(child->min_rank_, child));
       }
     }
   }
 }
 
+template <typename Count_t>
+void __stdcall quad_tree::query_rank_merge(
+  const DoubleRect& bounds,
+  top_k_buffer<Count_t>& results)
+{
+  // Either a node not yet opened, keyed by the minimum rank of its subtree,
+  // or a cursor over rank sorted points, keyed by the rank of its next
+  // point.
+  struct merge_entry
+  {
+    int32_t rank_;
+    const quad_tree::node* node_;
+    const Point* next_;
+    const Point* end_;
+    bool contained_;
+
+    bool operator>(const merge_entry& rhs) const
+    {
+      return rank_ > rhs.rank_;
+    }
+  };
+
+  scratch_heap<merge_entry> heap(thread_scratch<merge_entry>());
+  heap.push(merge_entry{ root_->min_rank_, root_, nullptr, nullptr, false });
+
+  const int32_t count = results.capacity();
+  int32_t hits = 0;
+  while (not heap.empty() && hits < count) {
+    const merge_entry curr = heap.top();
+    if (curr.rank_ > results.threshold()) {
+      break;
+    }
+    heap.pop();
+
+    if (curr.node_ != nullptr) {
+      // A cursor keeps the minimum rank of its node as its key, the first
+      // point of a leaf or a sample, so the points are not read until the
+      // cursor comes up.
+      const quad_tree::node* n = curr.node_;
+      Overlap overlap = classify(bounds, n->point_bounds_);
+      const bool contained = overlap == Overlap::Contained;
+      if (overlap == Overlap::Disjoint) {
+        continue;
+      } else if (!n->points_.empty()) {
+        heap.push(merge_entry{ n->min_rank_, nullptr,
+          n->points_.data(), n->points_.data() + n->points_.size(),
+          contained });
+      } else if (contained && !n->top_k_.empty() &&
+        (n->top_k_.size() == n->point_count_ ||
+          static_cast<std::size_t>(count) <= n->top_k_.size())) {
+        if (prefetch_distance_ != 0) {
+          prefetch(n->top_k_.data(), PREFETCH_LEAF_LINES * CACHE_LINE_SIZE);
+        }
+        heap.push(merge_entry{ n->min_rank_, nullptr,
+          n->top_k_.data(), n->top_k_.data() + n->top_k_.size(), true });
+      } else {
+        if (prefetch_distance_ != 0) {
+          for (std::size_t i = 0; i < 4; ++i) {
+            if (n->children_[i] != nullptr) {
+              prefetch(n->children_[i], sizeof(node));
+            }
+          }
+        }
+        for (std::size_t i = 0; i < 4; ++i) {
+          const quad_tree::node* child = n->children_[i];
+          if (child != nullptr) {
+            if (prefetch_distance_ != 0 &&
+              child->min_rank_ <= results.threshold()) {
+              prefetch_leaf(child);
+            }
+            heap.push(merge_entry{ child->min_rank_, child, nullptr, nullptr,
+              false });
+          }
+        }
+      }
+      continue;
+    }
+
+    // Drain the cursor for as long as it stays the lowest ranked source,
+    // without going back through the heap.
+    const Point* it = curr.next_;
+    for (; it != curr.end_ && hits < count; ++it) {
+      if (not heap.empty() && it->rank > heap.top().rank_) {
+        break;
+      } else if (curr.contained_ || point_inside(*it, bounds)) {
+        if (!results.offer(*it)) {
+          // Ranks only grow from here.
+          return;
+        }
+        ++hits;
+      }
+    }
+    if (it != curr.end_ && hits < count) {
+      heap.push(merge_entry{ it->rank, nullptr, it, curr.end_,
+        curr.contained_ });
+    }
+  }
+}
+
+void __stdcall quad_tree::prefetch_leaf(const node* curr) const
+{
+  if (!curr->points_.empty()) {
+    prefetch(curr->points_.data(), (std::min)(
+      curr->points_.size() * sizeof(Point),
+      PREFETCH_LEAF_LINES * CACHE_LINE_SIZE));
+  }
+}
+
+void __stdcall quad_tree::prefetch_leaf(const compact_node& curr) const
+{
+  if (curr.leaf_length_ == 0) {
+    return;
+  }
+  const std::size_t lines = PREFETCH_LEAF_LINES * CACHE_LINE_SIZE;
+  if (leaf_soa_.empty()) {
+    prefetch(point_pool_.data() + curr.leaf_offset_,
+      (std::min)(curr.leaf_length_ * sizeof(Point), lines));
+  } else if (leaf_soa_.is_quantized()) {
+    prefetch(leaf_soa_.rank() + curr.leaf_offset_, CACHE_LINE_SIZE);
+    prefetch(leaf_soa_.qx() + curr.leaf_offset_, CACHE_LINE_SIZE);
+    prefetch(leaf_soa_.qy() + curr.leaf_offset_, CACHE_LINE_SIZE);
+  } else {
+    prefetch(leaf_soa_.rank() + curr.leaf_offset_, CACHE_LINE_SIZE);
+    prefetch(leaf_soa_.x() + curr.leaf_offset_, CACHE_LINE_SIZE);
+    prefetch(leaf_soa_.y() + curr.leaf_offset_, CACHE_LINE_SIZE);
+  }
+}
+
 void __stdcall quad_tree::compute_bounds(
     std::vector<Point*>::iterator begin,
     std::vector<Point*>::iterator end,
     DoubleRect& out_rect)
 {
-  float max_y = -(std::numeric_limits<float>::max)();
-  float min_y = +(std::numeric_limits<float>::max)();
-  float max_x = -(std::numeric_limits<float>::max)();
-  float min_x = +(std::numeric_limits<float>::max)();
-
-  std::for_each(begin, end,
-    [&](const Point* it)
-    {
-      if (it->x < min_x) min_x = it->x;
-      if (it->x > max_x) max_x = it->x;
-      if (it->y < min_y) min_y = it->y;
-      if (it->y > max_y) max_y = it->y;
-      int x = 0;
-    });
+  out_rect = bounds_of(begin == end ? nullptr : &*begin,
+    static_cast<std::size_t>(std::distance(begin, end)));
+}
 
-  out_rect = { std::floor(min_x), std::floor(min_y),
-    std::ceil(max_x), std::ceil(max_y) };
+void __stdcall quad_tree::compute_bounds(
+    const Point* begin,
+    const Point* end,
+    DoubleRect& out_rect)
+{
+  out_rect = bounds_of(begin, static_cast<std::size_t>(end - begin));
 }
 
 void __stdcall quad_tree::create(
@@ -495,10 +1195,50 @@ void __stdcall quad_tree::create(
   const std::size_t min_block_size,
   const std::size_t max_block_size)
 {
+  // Only a parallel build fills the arena from several threads.
+  node_arena_.set_thread_safe(options_.build_threads != 1u);
   compute_bounds(begin, end, global_bounds_);
-  root_ = new node(compute_quad_key(**begin, 0u, global_bounds_),
+  root_ = new_node(compute_quad_key(**begin, 0u, global_bounds_),
     global_bounds_);
-  build_tree(root_, begin, end, 0u, min_block_size, max_block_size);
+  std::size_t build_bytes = 0;
+  auto build = [&]()
+  {
+    if (options_.bulk_load &&
+      options_.split_policy == SplitPolicy::Midpoint) {
+      build_bytes = bulk_load(begin, end, max_block_size);
+    } else {
+      build_tree(root_, begin, end, 0u, min_block_size, max_block_size);
+    }
+  };
+  if (options_.build_threads != 1u) {
+    task_pool pool(options_.build_threads);
+    build_pool_ = &pool;
+    try {
+      build();
+    } catch (...) {
+      build_pool_ = nullptr;
+      throw;
+    }
+    build_pool_ = nullptr;
+  } else {
+    build();
+  }
+
+  // The constructor holds the pointer array through the whole build.
+  const std::size_t pointer_bytes = std::distance(begin, end) *
+    sizeof(Point*);
+  const std::size_t tree_bytes = node_arena_.capacity_bytes();
+  build_stats_.peak_bytes = pointer_bytes + (std::max)(build_bytes,
+    tree_bytes);
+  build_stats_.index_bytes = tree_bytes;
+
+  if (options_.compact_nodes || options_.leaf_layout != LeafLayout::Packed) {
+    // The pointer nodes are released only after the compact copy is made.
+    const std::size_t compact_build_bytes = build_compact();
+    build_stats_.index_bytes = compact_bytes();
+    build_stats_.peak_bytes = (std::max)(build_stats_.peak_bytes,
+      pointer_bytes + tree_bytes + compact_build_bytes);
+  }
 }
 
 void __stdcall quad_tree::build_tree(node* node, 
@@ -514,103 +1254,338 @@ void __stdcall quad_tree::build_tree(node* node,
     return;
   }
 
-  typedef std::tuple<uint64_t, std::vector<Point*>, std::size_t> BucketItem_t;
-  std::function<quad_tree::node * (BucketItem_t&)>
+  std::function<quad_tree::node * (uint64_t,
+    std::vector<Point*>::iterator, std::vector<Point*>::iterator)>
     build_node =
-    [&](BucketItem_t& bucket)
+    [&](uint64_t id,
+      std::vector<Point*>::iterator child_begin,
+      std::vector<Point*>::iterator child_end)
     {
-      auto& id = std::get<0>(bucket);
       std::uint8_t depth = msb64(id) / 2;
 
       DoubleRect point_bounds;
       if (depth <= 0) {
         compute_bounds_for_quad_key(id, global_bounds_, point_bounds);
       } else {
-        compute_bounds(
-          std::get<1>(bucket).begin(),
-          std::get<1>(bucket).begin() + std::get<2>(bucket),
-          point_bounds);
+        compute_bounds(child_begin, child_end, point_bounds);
       }
 
-      quad_tree::node* ret = new quad_tree::node(id, point_bounds);
-      return ret;
+      return new_node(id, point_bounds);
     };
 
   if (count > max_block_size && depth != max_depth()) {
-    Bucket_t buckets;
-    get_buckets(begin, end, depth, count, global_bounds_, buckets);
-
-    if (std::get<2>(buckets[0]) != 0) {
-      quad_tree::node* child0 = build_node(buckets[0]);
-      node->children_[0] = child0;
-      build_tree(
-        child0,
-        std::get<1>(buckets[0]).begin(),
-        std::get<1>(buckets[0]).begin() + std::get<2>(buckets[0]),
-        depth + 1,
-        min_block_size,
-        max_block_size);
-    }
-
-    if (std::get<2>(buckets[1]) != 0) {
-      quad_tree::node* child1 = build_node(buckets[1]);
-      node->children_[1] = child1;
-      build_tree(
-        child1,
-        std::get<1>(buckets[1]).begin(),
-        std::get<1>(buckets[1]).begin() + std::get<2>(buckets[1]),
-        depth + 1,
-        min_block_size,
-        max_block_size);
-    }
-
-    if (std::get<2>(buckets[2]) != 0) {
-      quad_tree::node* child2 = build_node(buckets[2]);
-      node->children_[2] = child2;
-      build_tree(
-        child2,
-        std::get<1>(buckets[2]).begin(),
-        std::get<1>(buckets[2]).begin() + std::get<2>(buckets[2]),
-        depth + 1,
-        min_block_size,
-        max_block_size);
-    }
-
-    if (std::get<2>(buckets[3]) != 0) {
-      quad_tree::node* child3 = build_node(buckets[3]);
-      node->children_[3] = child3;
-      build_tree(
-        child3,
-        std::get<1>(buckets[3]).begin(),
-        std::get<1>(buckets[3]).begin() + std::get<2>(buckets[3]),
-        depth + 1,
-        min_block_size,
-        max_block_size);
+    std::vector<Point*>::iterator quadrants[5];
+    uint64_t first_child = partition_children(node, begin, end, depth,
+      quadrants);
+    if (fills_one_quadrant(quadrants, count) && spans_one_cell(begin, end)) {
+      // Splitting would hand every point to the same child down to
+      // max_depth(), keep them as one oversized leaf instead.
+      node->set_data(begin, end);
+      return;
     }
+
+    // Children are built into the slots of node, so the finished tree does
+    // not depend on which thread built which subtree.
+    task_pool::task_group children;
+    try {
+      for (std::size_t i = 0; i < 4; ++i) {
+        auto child_begin = quadrants[i];
+        auto child_end = quadrants[i + 1];
+        const std::size_t child_size = std::distance(child_begin, child_end);
+        if (child_size == 0) {
+          continue;
+        }
+        quad_tree::node* child = build_node(first_child + i, child_begin,
+          child_end);
+        node->children_[i] = child;
+        auto build_child = [=]()
+        {
+          build_tree(child, child_begin, child_end, depth + 1,
+            min_block_size, max_block_size);
+        };
+        if (build_pool_ != nullptr &&
+          child_size >= options_.parallel_cutoff) {
+          build_pool_->run(children, build_child);
+        } else {
+          build_child();
+        }
+      }
+    } catch (...) {
+      // Queued siblings still work on the range.
+      if (build_pool_ != nullptr) {
+        try {
+          build_pool_->wait(children);
+        } catch (...) {
+        }
+      }
+      throw;
+    }
+    if (build_pool_ != nullptr) {
+      build_pool_->wait(children);
+    }
+
+    summarize_children(node);
   } else {
     node->set_data(begin, end);
   }
 }
 
+void __stdcall quad_tree::summarize_children(node* node)
+{
+  for (quad_tree::node* child : node->children_) {
+    if (child != nullptr) {
+      node->min_rank_ = (std::min)(node->min_rank_, child->min_rank_);
+      node->point_count_ += child->point_count_;
+    }
+  }
+  build_top_k(node);
+}
+
+std::size_t __stdcall quad_tree::bulk_load(
+  std::vector<Point*>::iterator begin,
+  std::vector<Point*>::iterator end,
+  const std::size_t max_block_size)
+{
+  const std::size_t size = std::distance(begin, end);
+  if (size > (std::numeric_limits<uint32_t>::max)()) {
+    throw std::runtime_error(std::string(__FUNCTION__) +
+      " cannot sort more than " +
+      std::to_string((std::numeric_limits<uint32_t>::max)()) + " points.");
+  }
+
+  const uint8_t depth = max_depth();
+  std::vector<uint64_t> keys(size);
+  std::vector<uint32_t> order(size);
+  compute_quad_keys(&*begin, size, depth, global_bounds_, keys.data());
+  for (std::size_t i = 0; i < size; ++i) {
+    order[i] = static_cast<uint32_t>(i);
+  }
+  std::size_t sort_bytes = 0;
+  radix_sort(keys, order, build_pool_, &sort_bytes);
+
+  // The keys are held to the end, the order until the pointers are
+  // gathered in key order.
+  const std::size_t key_bytes = keys.capacity() * sizeof(uint64_t);
+  const std::size_t order_bytes = order.capacity() * sizeof(uint32_t);
+  std::vector<Point*> sorted(size);
+  const std::size_t sorted_bytes = sorted.capacity() * sizeof(Point*);
+  std::size_t peak_bytes = node_arena_.capacity_bytes() + key_bytes +
+    order_bytes + (std::max)(sort_bytes, sorted_bytes);
+  for (std::size_t i = 0; i < size; ++i) {
+    sorted[i] = begin[order[i]];
+  }
+  order.clear();
+  order.shrink_to_fit();
+
+  build_sorted(root_, sorted.begin(), sorted.end(), keys.cbegin(), 0u,
+    max_block_size);
+  return (std::max)(peak_bytes,
+    node_arena_.capacity_bytes() + key_bytes + sorted_bytes);
+}
+
+void __stdcall quad_tree::build_sorted(node* node,
+  std::vector<Point*>::iterator begin,
+  std::vector<Point*>::iterator end,
+  std::vector<uint64_t>::const_iterator keys,
+  uint8_t depth,
+  const std::size_t max_block_size)
+{
+  const std::size_t count = std::distance(begin, end);
+  // Sorted keys that agree at both ends agree everywhere, so the points
+  // share one cell at max_depth() and would never be split.
+  if (count <= max_block_size || depth == max_depth() ||
+    keys[0] == keys[count - 1]) {
+    compute_bounds(begin, end, node->point_bounds_);
+    node->set_data(begin, end);
+    return;
+  }
+
+  // The quad_key of a point at depth d is its max depth key shifted down
+  // by two bits per level below d, so the children of node are the runs of
+  // equal key bits at depth + 1.
+  const uint64_t shift = 2ull * (max_depth() - (depth + 1u));
+  task_pool::task_group children;
+  try {
+    std::size_t child_begin = 0;
+    for (uint64_t quadrant = 0; quadrant < 4; ++quadrant) {
+      const std::size_t child_end = std::partition_point(
+        keys + child_begin, keys + count,
+        [&](uint64_t key)
+        {
+          return ((key >> shift) & 0x3ull) <= quadrant;
+        }) - keys;
+      const std::size_t child_size = child_end - child_begin;
+      if (child_size != 0) {
+        // Bounds are filled in once the child is built.
+        quad_tree::node* child = new_node(keys[child_begin] >> shift,
+          DoubleRect{});
+        node->children_[quadrant] = child;
+        auto build_child = [=]()
+        {
+          build_sorted(child, begin + child_begin, begin + child_end,
+            keys + child_begin, depth + 1, max_block_size);
+        };
+        if (build_pool_ != nullptr &&
+          child_size >= options_.parallel_cutoff) {
+          build_pool_->run(children, build_child);
+        } else {
+          build_child();
+        }
+      }
+      child_begin = child_end;
+    }
+  } catch (...) {
+    if (build_pool_ != nullptr) {
+      try {
+        build_pool_->wait(children);
+      } catch (...) {
+      }
+    }
+    throw;
+  }
+  if (build_pool_ != nullptr) {
+    build_pool_->wait(children);
+  }
+
+  // Flooring and ceiling the bounds commutes with taking their union, so
+  // this matches compute_bounds over all points of node.
+  bool first = true;
+  for (quad_tree::node* child : node->children_) {
+    if (child == nullptr) {
+      continue;
+    }
+    const DoubleRect& bounds = child->point_bounds_;
+    if (first) {
+      node->point_bounds_ = bounds;
+      first = false;
+    } else {
+      node->point_bounds_.lx = (std::min)(node->point_bounds_.lx, bounds.lx);
+      node->point_bounds_.ly = (std::min)(node->point_bounds_.ly, bounds.ly);
+      node->point_bounds_.hx = (std::max)(node->point_bounds_.hx, bounds.hx);
+      node->point_bounds_.hy = (std::max)(node->point_bounds_.hy, bounds.hy);
+    }
+  }
+  summarize_children(node);
+}
+
+void __stdcall quad_tree::build_top_k(node* node)
+{
+  const std::size_t k = options_.top_k_size;
+  if (k == 0) {
+    return;
+  }
+
+  // Candidates are gathered on the heap so the arena only ever holds the
+  // final, exactly sized sample.
+  std::vector<Point> top_k;
+  for (quad_tree::node* child : node->children_) {
+    if (child == nullptr) {
+      continue;
+    }
+    const node::Points_t& sample = child->points_.empty() ?
+      child->top_k_ : child->points_;
+    std::size_t take = (std::min)(k, sample.size());
+    top_k.insert(top_k.end(), sample.begin(), sample.begin() + take);
+  }
+
+  std::size_t keep = (std::min)(k, top_k.size());
+  std::partial_sort(top_k.begin(), top_k.begin() + keep, top_k.end());
+  node->top_k_.assign(top_k.begin(), top_k.begin() + keep);
+}
+
 std::size_t __stdcall quad_tree::size() const
 {
-  std::size_t ret = 0;
+  if (!compact_nodes_.empty()) {
+    return compact_nodes_.front().point_count_ + outliers_.size();
+  }
+  std::size_t ret = outliers_.size();
   quad_tree::size_recursive(root_, ret);
   return ret;
 }
 
-void __stdcall quad_tree::destroy_tree(node* curr)
+std::size_t __stdcall quad_tree::outlier_count() const
+{
+  return outliers_.size();
+}
+
+std::size_t __stdcall quad_tree::node_count() const
+{
+  if (!compact_nodes_.empty()) {
+    return compact_nodes_.size();
+  }
+  std::size_t ret = 0;
+  node_count_recursive(root_, ret);
+  return ret;
+}
+
+std::size_t __stdcall quad_tree::height() const
+{
+  if (!compact_nodes_.empty()) {
+    return compact_height(0u);
+  }
+  return height_recursive(root_);
+}
+
+std::size_t __stdcall quad_tree::height_recursive(const node* curr) const
+{
+  if (curr == nullptr) {
+    return 0u;
+  }
+  std::size_t ret = 0u;
+  for (const quad_tree::node* child : curr->children_) {
+    ret = (std::max)(ret, height_recursive(child));
+  }
+  return ret + 1u;
+}
+
+std::size_t __stdcall quad_tree::compact_height(uint32_t index) const
+{
+  std::size_t ret = 0u;
+  for (uint32_t child : compact_nodes_[index].children_) {
+    if (child != NO_CHILD) {
+      ret = (std::max)(ret, compact_height(child));
+    }
+  }
+  return ret + 1u;
+}
+
+const quad_tree::BuildStats& __stdcall quad_tree::build_stats() const
+{
+  return build_stats_;
+}
+
+std::size_t __stdcall quad_tree::compact_bytes() const
+{
+  return compact_nodes_.capacity() * sizeof(compact_node) +
+    point_pool_.capacity() * sizeof(Point) + leaf_soa_.capacity_bytes();
+}
+
+void __stdcall quad_tree::node_count_recursive(
+  node* curr,
+  std::size_t& count) const
 {
   if (curr == nullptr) {
     return;
-  } else {
-    destroy_tree(curr->children_[0]);
-    destroy_tree(curr->children_[1]);
-    destroy_tree(curr->children_[2]);
-    destroy_tree(curr->children_[3]);
-    delete curr;
-    curr = nullptr;
   }
+  ++count;
+  for (quad_tree::node* child : curr->children_) {
+    node_count_recursive(child, count);
+  }
+}
+
+quad_tree::node* __stdcall quad_tree::new_node(uint64_t quad_key,
+  const DoubleRect& point_bounds)
+{
+  void* memory = node_arena_.allocate(sizeof(node), alignof(node));
+  return new (memory) node(quad_key, point_bounds, node_arena_);
+}
+
+void __stdcall quad_tree::destroy_tree()
+{
+  // Nodes hold nothing but arena memory, releasing the arena frees the
+  // whole tree without visiting it.
+  node_arena_.release();
+  root_ = nullptr;
 }
 
 void __stdcall quad_tree::size_recursive(node* curr, std::size_t& count) const
@@ -652,64 +1627,167 @@ void __stdcall quad_tree::print_tree(node* curr)
   }
 }
 
-void __stdcall quad_tree::get_buckets(std::vector<Point*>::iterator begin,
-  std::vector<Point*>::iterator end, uint8_t depth, std::size_t count,
-  const DoubleRect& global_bounds, Bucket_t& out_buckets)
+uint64_t __stdcall quad_tree::partition_children(
+  const node* node,
+  std::vector<Point*>::iterator begin,
+  std::vector<Point*>::iterator end,
+  uint8_t depth,
+  std::vector<Point*>::iterator (&out_quadrants)[5]) const
 {
-  const Point& ip = **begin;
-  uint64_t p_pid = compute_quad_key(ip, depth, global_bounds);
   Children_t children;
+  out_quadrants[0] = begin;
+  out_quadrants[4] = end;
+
+  if (options_.split_policy != SplitPolicy::Midpoint) {
+    // The children take the next keys below node whatever the cut.
+    compute_children(node->quad_key_, children);
+    auto y = [](const Point* p) { return p->y; };
+    auto x = [](const Point* p) { return p->x; };
+    if (options_.split_policy == SplitPolicy::Median) {
+      out_quadrants[2] = split_at_median(begin, end, y);
+      out_quadrants[1] = split_at_median(begin, out_quadrants[2], x);
+      out_quadrants[3] = split_at_median(out_quadrants[2], end, x);
+    } else {
+      out_quadrants[2] = split_by_cost(begin, end, y, x);
+      out_quadrants[1] = split_by_cost(begin, out_quadrants[2], x, y);
+      out_quadrants[3] = split_by_cost(out_quadrants[2], end, x, y);
+    }
+    return children[0];
+  }
+
+  const Point& ip = **begin;
+  uint64_t p_pid = compute_quad_key(ip, depth, global_bounds_);
   compute_children(p_pid, children);
-  out_buckets[0] = std::make_tuple(children[0], std::vector<Point*>(), 0ull);
-  out_buckets[1] = std::make_tuple(children[1], std::vector<Point*>(), 0ull);
-  out_buckets[2] = std::make_tuple(children[2], std::vector<Point*>(), 0ull);
-  out_buckets[3] = std::make_tuple(children[3], std::vector<Point*>(), 0ull);
+
+  const uint64_t min_id = children[0];
+  auto quadrant = [&](const Point* p)
+  {
+    return child_quadrant(*p, depth, global_bounds_);
+  };
+
+  // Split the lower from the upper two quadrants, then each half in two.
+  auto middle = std::partition(begin, end,
+    [&](const Point* p)
+    {
+      return quadrant(p) < 2ull;
+    });
+  out_quadrants[1] = std::partition(begin, middle,
+    [&](const Point* p)
+    {
+      return quadrant(p) < 1ull;
+    });
+  out_quadrants[2] = middle;
+  out_quadrants[3] = std::partition(middle, end,
+    [&](const Point* p)
+    {
+      return quadrant(p) < 3ull;
+    });
+  return min_id;
+}
+
+bool __stdcall quad_tree::fills_one_quadrant(
+  const std::vector<Point*>::iterator (&quadrants)[5],
+  std::size_t count)
+{
   for (std::size_t i = 0; i < 4; ++i) {
-    auto& v = std::get<1>(out_buckets[i]);
-    v.reserve(count);
+    if (static_cast<std::size_t>(
+      std::distance(quadrants[i], quadrants[i + 1])) == count) {
+      return true;
+    }
   }
+  return false;
+}
 
-  const uint64_t min_id = std::get<0>(out_buckets[0]);
-  std::vector<Point*>::iterator it = begin;
-  while (it != end) {
-    Point& p = **it;
-    uint64_t c_pid = compute_quad_key(p, depth + 1, global_bounds);
-    std::size_t bucket_index = c_pid - min_id;
-    auto& vec = std::get<1>(out_buckets[bucket_index]);
-    vec.push_back(&p);
-    ++it;
+bool __stdcall quad_tree::spans_one_cell(
+  std::vector<Point*>::iterator begin,
+  std::vector<Point*>::iterator end) const
+{
+  if (options_.split_policy != SplitPolicy::Midpoint) {
+    return false;
   }
 
-  for (std::size_t i = 0; i < 4; ++i) {
-    std::get<2>(out_buckets[i]) = std::get<1>(out_buckets[i]).size();
+  Point lower = **begin;
+  Point upper = **begin;
+  for (std::vector<Point*>::iterator it = begin; it != end; ++it) {
+    lower.x = (std::min)(lower.x, (*it)->x);
+    lower.y = (std::min)(lower.y, (*it)->y);
+    upper.x = (std::max)(upper.x, (*it)->x);
+    upper.y = (std::max)(upper.y, (*it)->y);
+  }
+  // Keys grow with x and y, so corners sharing the deepest cell mean every
+  // point between them does too, identical coordinates included.
+  return compute_quad_key(lower, max_depth(), global_bounds_) ==
+    compute_quad_key(upper, max_depth(), global_bounds_);
+}
+
+void __stdcall quad_tree::compute_outlier_fence(
+  const Point* begin,
+  const Point* end,
+  DoubleRect& out_fence)
+{
+  const std::size_t size = std::distance(begin, end);
+
+  // Fences are read from quantiles of an even sample of the coordinates,
+  // which does not depend on input order.
+  const std::size_t stride = (std::max)(std::size_t(1),
+    size / OUTLIER_SAMPLE_SIZE);
+  std::vector<float> xs;
+  std::vector<float> ys;
+  xs.reserve(size / stride + 1);
+  ys.reserve(size / stride + 1);
+  for (std::size_t i = 0; i < size; i += stride) {
+    if (std::isfinite(begin[i].x) && std::isfinite(begin[i].y)) {
+      xs.push_back(begin[i].x);
+      ys.push_back(begin[i].y);
+    }
+  }
+
+  out_fence = {
+    +std::numeric_limits<double>::infinity(),
+    +std::numeric_limits<double>::infinity(),
+    -std::numeric_limits<double>::infinity(),
+    -std::numeric_limits<double>::infinity()
+  };
+  if (!xs.empty()) {
+    const std::size_t tail = static_cast<std::size_t>(
+      static_cast<double>(xs.size()) * OUTLIER_TAIL);
+    auto quantiles = [&](std::vector<float>& values, double& out_lo,
+      double& out_hi)
+    {
+      std::nth_element(values.begin(), values.begin() + tail, values.end());
+      const double lo = values[tail];
+      std::nth_element(values.begin() + tail,
+        values.end() - 1 - tail, values.end());
+      const double hi = *(values.end() - 1 - tail);
+      out_lo = lo - OUTLIER_FENCE * (hi - lo);
+      out_hi = hi + OUTLIER_FENCE * (hi - lo);
+    };
+    quantiles(xs, out_fence.lx, out_fence.hx);
+    quantiles(ys, out_fence.ly, out_fence.hy);
   }
 }
 
 std::size_t __stdcall quad_tree::points_to_vector(const Point* point_begin,
   const Point* point_end, std::vector<Point*>& out_vec, quad_tree& t)
 {
-  std::ptrdiff_t size = std::distance(point_begin, point_end);
-  Point* citer = const_cast<Point*>(point_begin);
-  Point* piter = const_cast<Point*>(point_begin);
+  const std::size_t size = std::distance(point_begin, point_end);
   out_vec.clear();
   out_vec.reserve(size);
-  std::size_t i = 0;
-  while (citer != point_end) {
-    bool insert = true;
-    if (piter != citer) {
-      double dist = std::sqrt(
-        std::pow(citer->x - piter->x, 2.0) +
-        std::pow(citer->y - piter->y, 2.0));
-      insert = (dist < 100000.0);
-    }
-    if (insert) {
-      out_vec.push_back(citer);
+
+  DoubleRect fence;
+  compute_outlier_fence(point_begin, point_end, fence);
+  for (const Point* it = point_begin; it != point_end; ++it) {
+    if (inside_fence(*it, fence)) {
+      out_vec.push_back(const_cast<Point*>(it));
     } else {
-      t.outliers_.push_back(*citer);
+      t.outliers_.push_back(*it);
     }
-    ++i;
-    piter = citer;
-    ++citer;
   }
+  std::sort(t.outliers_.begin(), t.outliers_.end(),
+    [&](const Point& lhs, const Point& rhs)
+    {
+      return lhs.rank < rhs.rank;
+    });
+  t.outliers_.shrink_to_fit();
   return size;
 }
@@ -11,7 +11,12 @@
 #include <tuple>
 #include <vector>
 
+#include "aligned_allocator.h"
+#include "arena.h"
 #include "ipoint_search.h"
+#include "soa_points.h"
+#include "task_pool.h"
+#include "top_k_buffer.h"
 
 /// <summary>
 /// To encrease the accuracy of subdivision and to allow for further depths
@@ -41,6 +46,17 @@ inline std::stringstream& operator<<(
   return ss;
 }
 
+/// <summary>
+/// How the bounds of a region relate to a query rect. Disjoint regions hold
+/// no results, Contained regions hold only results and Straddling regions
+/// need their points checked one by one.
+/// </summary>
+enum class Overlap {
+  Disjoint = 0,
+  Contained = 1,
+  Straddling = 2
+};
+
 /// <summary>
 /// A quad_tree class for spatially partioning points. Each node in the tree
 /// is encoded using Morton Encoding. The depths 0, 1, and 2 can be visualized
@@ -144,6 +160,36 @@ public:
     uint8_t depth,
     const DoubleRect &bounds);
 
+  /// <summary>
+  /// Computes <see cref="quad_tree::compute_quad_key"/> for
+  /// <paramref name="count"/> points at once. Coordinates are normalized
+  /// four at a time with AVX2 and interleaved with BMI2 pdep when the CPU
+  /// has them, otherwise point by point. The keys are always the same as
+  /// those of <see cref="quad_tree::compute_quad_key"/>.
+  /// </summary>
+  /// <param name="points">The first of <paramref name="count"/> points.</param>
+  /// <param name="count">The number of points to key.</param>
+  /// <param name="depth">The depth of every key.</param>
+  /// <param name="bounds">The bounds all points are hashed within.</param>
+  /// <param name="out_keys">Receives <paramref name="count"/> keys.</param>
+  static void __stdcall compute_quad_keys(
+    const Point* points,
+    std::size_t count,
+    uint8_t depth,
+    const DoubleRect& bounds,
+    uint64_t* out_keys);
+
+  /// <summary>
+  /// <see cref="quad_tree::compute_quad_keys"/> for an array of pointers to
+  /// points.
+  /// </summary>
+  static void __stdcall compute_quad_keys(
+    const Point* const* points,
+    std::size_t count,
+    uint8_t depth,
+    const DoubleRect& bounds,
+    uint64_t* out_keys);
+
   /// <summary>
   /// Each depth in the quad_tree has a minimum and maximum uint64_t
   /// morton encoded value. For examle at depth 0
@@ -241,9 +287,14 @@ private:
       UpperRight = 3
     };
 
-    __stdcall node(uint64_t quad_key, const DoubleRect &point_bounds);
+    typedef std::vector<Point, arena_allocator<Point>> Points_t;
 
-    __stdcall ~node();
+    /// <summary>
+    /// Nodes and their point arrays live in the owning quad_tree's
+    /// <see cref="arena"/> and are never destroyed one by one.
+    /// </summary>
+    __stdcall node(uint64_t quad_key, const DoubleRect &point_bounds,
+      arena& owner);
 
     void __stdcall set_data(
       std::vector<Point *>::iterator begin,
@@ -252,16 +303,202 @@ private:
     void __stdcall set_child(const ChildId id, node* child);
 
     uint64_t quad_key_;
-    std::vector<Point> points_;
+    Points_t points_;
     node* children_[4];
     DoubleRect point_bounds_;
+    int32_t min_rank_;
+    std::size_t point_count_;
+    Points_t top_k_;
   };
 
-  typedef std::tuple<uint64_t, std::vector<Point*>, uint64_t> Bucket_t[4];
+  constexpr static uint32_t NO_CHILD = 0xFFFFFFFFu;
+
+  /// <summary>
+  /// A <see cref="quad_tree::node"/> packed into a single cache line. Bounds
+  /// are stored as floats rounded outwards, children are indices into the
+  /// compact node array and leaf points and top-K samples are ranges of a
+  /// shared point pool.
+  /// </summary>
+  struct alignas(64) compact_node
+  {
+    Rect point_bounds_;
+    uint32_t children_[4];
+    uint32_t leaf_offset_;
+    uint32_t leaf_length_;
+    uint32_t top_k_offset_;
+    uint32_t top_k_length_;
+    int32_t min_rank_;
+    uint32_t point_count_;
+    uint64_t quad_key_;
+  };
+  static_assert(sizeof(compact_node) == 64,
+    "compact_node must fill exactly one cache line.");
 
 public:
   constexpr static std::size_t MAX_BLOCK_SIZE = 1000ull;
   constexpr static std::size_t MIN_BLOCK_SIZE = 10ull;
+  constexpr static std::size_t TOP_K_SIZE = 32ull;
+  constexpr static std::size_t PARALLEL_BUILD_CUTOFF = 16384ull;
+  constexpr static std::size_t PREFETCH_DISTANCE = 4ull;
+  constexpr static std::size_t PREFETCH_LEAF_LINES = 2ull;
+
+  /// <summary>
+  /// Points built from a contiguous block are checked against fences
+  /// around the <see cref="quad_tree::OUTLIER_TAIL"/> and
+  /// 1 - <see cref="quad_tree::OUTLIER_TAIL"/> quantiles of each axis,
+  /// estimated from at most <see cref="quad_tree::OUTLIER_SAMPLE_SIZE"/>
+  /// evenly spaced points and widened on both sides by
+  /// <see cref="quad_tree::OUTLIER_FENCE"/> times the span between them.
+  /// Points outside the fences, or with NaN or infinite coordinates, go to a
+  /// small rank sorted sidecar merged into every query, so they cannot
+  /// stretch the bounds the tree is built in.
+  /// </summary>
+  constexpr static std::size_t OUTLIER_SAMPLE_SIZE = 65536ull;
+  constexpr static double OUTLIER_TAIL = 1.0 / 4096.0;
+  constexpr static double OUTLIER_FENCE = 1.0;
+
+  /// <summary>
+  /// How the points of compact leaves are stored. Packed keeps the 13 byte
+  /// <see cref="Point"/>s. Soa splits them into aligned coordinate, rank and
+  /// id arrays, see <see cref="soa_points"/>, so leaves can be filtered with
+  /// <see cref="filter_rect_block"/> a block of points at a time. Quantized
+  /// adds 16 bit coordinates relative to the leaf bounds to the Soa arrays,
+  /// filtered with <see cref="filter_quantized_block"/> at twice the lanes
+  /// and half the memory traffic, with exact float checks only for points
+  /// on the edges of the query rect.
+  /// </summary>
+  enum class LeafLayout {
+    Packed = 0,
+    Soa = 1,
+    Quantized = 2
+  };
+
+  /// <summary>
+  /// Where a node is cut into its four children. Midpoint cuts the node's
+  /// morton cell in half on both axes, so children are quad_key cells of
+  /// <see cref="quad_tree::global_bounds"/>. Median cuts at the median y
+  /// and then at the median x of each half, kd-tree style, so every child
+  /// holds about a quarter of the points and the height never exceeds
+  /// log4(N / max_block_size) + 1. SurfaceArea cuts y and then x of each
+  /// half at the plane, out of <see cref="quad_tree::SPLIT_BINS"/> binned
+  /// candidates, that minimizes the half perimeter of each side times its
+  /// point count, which isolates clusters from sparse space around them.
+  /// With Median and SurfaceArea a quad_key only names a node's place in
+  /// the tree, not a cell of space.
+  /// </summary>
+  enum class SplitPolicy {
+    Midpoint = 0,
+    Median = 1,
+    SurfaceArea = 2
+  };
+
+  constexpr static std::size_t SPLIT_BINS = 16ull;
+
+  /// <summary>
+  /// Optional settings used while building a quad_tree.
+  /// </summary>
+  struct BuildOptions
+  {
+    BuildOptions() :
+      top_k_size(TOP_K_SIZE),
+      compact_nodes(false),
+      leaf_layout(LeafLayout::Packed),
+      build_threads(1u),
+      parallel_cutoff(PARALLEL_BUILD_CUTOFF),
+      bulk_load(false),
+      split_policy(SplitPolicy::Midpoint)
+    {
+    }
+
+    /// <summary>
+    /// The number of lowest ranked points materialized at every internal
+    /// <see cref="quad_tree::node"/>. Queries that fully cover a node and
+    /// ask for at most this many points are answered from the sample
+    /// without descending. 0 disables the samples.
+    /// </summary>
+    std::size_t top_k_size;
+
+    /// <summary>
+    /// When set the finished tree is re-emitted as an array of cache line
+    /// sized compact nodes laid out level by level over one shared point
+    /// pool, and the pointer based nodes are released.
+    /// </summary>
+    bool compact_nodes;
+
+    /// <summary>
+    /// The storage of leaf points. Anything other than
+    /// <see cref="quad_tree::LeafLayout::Packed"/> implies
+    /// <see cref="quad_tree::BuildOptions::compact_nodes"/>.
+    /// </summary>
+    LeafLayout leaf_layout;
+
+    /// <summary>
+    /// The number of threads building the tree. Above 1 every child subtree
+    /// of at least <see cref="quad_tree::BuildOptions::parallel_cutoff"/>
+    /// points becomes a task of a work stealing <see cref="task_pool"/>.
+    /// 0 uses every hardware thread. The tree built is the same for any
+    /// thread count.
+    /// </summary>
+    std::size_t build_threads;
+
+    /// <summary>
+    /// Subtrees with fewer points than this are built by the thread that
+    /// split their parent.
+    /// </summary>
+    std::size_t parallel_cutoff;
+
+    /// <summary>
+    /// When set every point is keyed once at <see cref="max_depth"/> and the
+    /// keys are sorted with <see cref="radix_sort"/>. Every node then owns a
+    /// contiguous range of the sorted points and is split by binary
+    /// searching the next two key bits, instead of recomputing the key of
+    /// every point at every depth. The tree built is the same. Only used
+    /// with <see cref="quad_tree::SplitPolicy::Midpoint"/>.
+    /// </summary>
+    bool bulk_load;
+
+    /// <summary>
+    /// How nodes are split, see <see cref="quad_tree::SplitPolicy"/>.
+    /// </summary>
+    SplitPolicy split_policy;
+  };
+
+  /// <summary>
+  /// Memory used by the last build of a quad_tree, in bytes.
+  /// </summary>
+  struct BuildStats
+  {
+    /// <summary>
+    /// The most memory held at once by the build. This is the pointer array
+    /// that is partitioned in place, plus whichever phase held the most:
+    /// the keys and sort buffers of
+    /// <see cref="quad_tree::BuildOptions::bulk_load"/>, the pointer nodes,
+    /// or the pointer nodes together with their compact copy.
+    /// </summary>
+    std::size_t peak_bytes;
+
+    /// <summary>
+    /// The memory held by the finished index.
+    /// </summary>
+    std::size_t index_bytes;
+  };
+
+  /// <summary>
+  /// The order in which <see cref="quad_tree::query"/> visits nodes.
+  /// BreadthFirst visits every node intersecting the query rect level by
+  /// level. BestFirst expands nodes in order of the minimum rank stored in
+  /// their subtree and stops once no remaining node can improve the result.
+  /// RankMerge merges the rank sorted points of every leaf the rect reaches
+  /// through one heap, in global rank order, and stops after count hits, so
+  /// no point is inserted into the result only to be evicted again. A leaf
+  /// is opened once the minimum rank of its subtree comes up, leaves that
+  /// cannot contribute are never read.
+  /// </summary>
+  enum class QueryMode {
+    BreadthFirst = 0,
+    BestFirst = 1,
+    RankMerge = 2
+  };
 
   /// <summary>
   /// Constructor for a quad_tree created from a contiguous block of
@@ -278,11 +515,15 @@ public:
   /// <param name="max_block_size">
   /// The maximum number of cells allowed in a <see cref="quad_tree::node"/>
   /// </param>
+  /// <param name="options">
+  /// Additional build settings, see <see cref="quad_tree::BuildOptions"/>.
+  /// </param>
   __stdcall quad_tree(
     const Point* point_begin,
     const Point* point_end,
     const std::size_t min_block_size = MIN_BLOCK_SIZE,
-    const std::size_t max_block_size = MAX_BLOCK_SIZE);
+    const std::size_t max_block_size = MAX_BLOCK_SIZE,
+    const BuildOptions& options = BuildOptions());
 
   /// <summary>
   /// Constructor for a quad_tree created from a contiguous block of
@@ -299,11 +540,15 @@ public:
   /// <param name="max_block_size">
   /// The maximum number of cells allowed in a <see cref="quad_tree::node"/>
   /// </param>
+  /// <param name="options">
+  /// Additional build settings, see <see cref="quad_tree::BuildOptions"/>.
+  /// </param>
   __stdcall quad_tree(
     std::vector<Point *>::iterator begin,
     std::vector<Point *>::iterator end,
     const std::size_t min_block_size = MIN_BLOCK_SIZE,
-    const std::size_t max_block_size = MAX_BLOCK_SIZE);
+    const std::size_t max_block_size = MAX_BLOCK_SIZE,
+    const BuildOptions& options = BuildOptions());
 
   /// <summary>
   /// Destroys a quad_tree.
@@ -320,7 +565,9 @@ public:
 
   /// <summary>
   /// Additional query function skipping the call back and filling in
-  /// the sorted points and how many where inserted.
+  /// the sorted points and how many where inserted. A count of 10, 20 or
+  /// 50 runs a traversal specialized for that count, see
+  /// <see cref="FixedCount"/>.
   /// </summary>
   /// <param name="query_rect">
   /// The query_rect.
@@ -336,12 +583,80 @@ public:
     int32_t& end_i, Point* out_points);
 
   /// <summary>
-  /// Computes the number of points stored within the tree. O(log4 (N)) where
-  /// N is the number of <see cref="quad_tree::node"/> s.
+  /// Selects the traversal used by <see cref="quad_tree::query"/>. Defaults
+  /// to <see cref="quad_tree::QueryMode::BestFirst"/>.
+  /// </summary>
+  /// <param name="mode">The traversal to use for subsequent queries.</param>
+  void __stdcall set_query_mode(QueryMode mode);
+
+  /// <summary>
+  /// The traversal currently used by <see cref="quad_tree::query"/>.
+  /// </summary>
+  /// <returns></returns>
+  QueryMode __stdcall query_mode() const;
+
+  /// <summary>
+  /// How far ahead <see cref="quad_tree::query"/> prefetches. Every node is
+  /// prefetched as it is queued. Breadth first, the first
+  /// <see cref="quad_tree::PREFETCH_LEAF_LINES"/> cache lines of the leaf
+  /// points of the node <paramref name="distance"/> places behind the one
+  /// being visited are prefetched. Only breadth first uses the distance.
+  /// Best first, rank merge and compact trees have no fixed visit order,
+  /// for them any non-zero distance turns on prefetching the leaf points of
+  /// a node once, as it is pushed and read for its rank, unless that rank
+  /// already cannot get into the result. 0 disables prefetching. Defaults
+  /// to <see cref="quad_tree::PREFETCH_DISTANCE"/>.
+  /// </summary>
+  /// <param name="distance">The number of nodes to look ahead.</param>
+  void __stdcall set_prefetch_distance(std::size_t distance);
+
+  /// <summary>
+  /// The look ahead set by <see cref="quad_tree::set_prefetch_distance"/>.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall prefetch_distance() const;
+
+  /// <summary>
+  /// Whether the tree was emitted as compact nodes, see
+  /// <see cref="quad_tree::BuildOptions::compact_nodes"/>. Compact trees are
+  /// always traversed best first.
+  /// </summary>
+  /// <returns></returns>
+  bool __stdcall is_compact() const;
+
+  /// <summary>
+  /// Computes the number of points stored within the tree, outliers
+  /// included. O(log4 (N)) where N is the number of
+  /// <see cref="quad_tree::node"/> s.
   /// </summary>
   /// <returns></returns>
   std::size_t __stdcall size() const;
 
+  /// <summary>
+  /// The number of points kept outside the tree, see
+  /// <see cref="quad_tree::OUTLIER_SAMPLE_SIZE"/>.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall outlier_count() const;
+
+  /// <summary>
+  /// The number of <see cref="quad_tree::node"/>s in the tree.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall node_count() const;
+
+  /// <summary>
+  /// The number of levels in the tree, 1 for a tree of only a root.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall height() const;
+
+  /// <summary>
+  /// The memory used while building this tree and held by the result.
+  /// </summary>
+  /// <returns></returns>
+  const BuildStats& __stdcall build_stats() const;
+
 public:
   /// <summary>
   /// This function finds the smallest axis aligned bounding box for
@@ -362,6 +677,53 @@ public:
     std::vector<Point *>::iterator end,
     DoubleRect& out_rect);
 
+  /// <summary>
+  /// This function finds the smallest axis aligned bounding box for
+  /// a contiguous block of points between <paramref name="begin"/> and
+  /// <paramref name="end"/>
+  /// </summary>
+  /// <param name="begin">The first <see cref="Point"/>.</param>
+  /// <param name="end">One address past the last <see cref="Point"/>.</param>
+  /// <param name="out_rect">Teh smallest axis aligned bounding box.</param>
+  static void __stdcall compute_bounds(
+    const Point* begin,
+    const Point* end,
+    DoubleRect& out_rect);
+
+  /// <summary>
+  /// Computes the fences a contiguous block of points between
+  /// <paramref name="begin"/> and <paramref name="end"/> is split into
+  /// inliers and outliers by, see
+  /// <see cref="quad_tree::OUTLIER_SAMPLE_SIZE"/>.
+  /// </summary>
+  /// <param name="begin">The first <see cref="Point"/>.</param>
+  /// <param name="end">One address past the last <see cref="Point"/>.</param>
+  /// <param name="out_fence">
+  /// The fences, empty when no point has finite coordinates.
+  /// </param>
+  static void __stdcall compute_outlier_fence(
+    const Point* begin,
+    const Point* end,
+    DoubleRect& out_fence);
+
+  /// <summary>
+  /// Whether <paramref name="point"/> lies inside
+  /// <paramref name="fence"/>. NaN coordinates never do.
+  /// </summary>
+  /// <param name="point">The point tested.</param>
+  /// <param name="fence">
+  /// The fences from <see cref="quad_tree::compute_outlier_fence"/>.
+  /// </param>
+  /// <returns></returns>
+  static inline bool __stdcall inside_fence(const Point& point,
+    const DoubleRect& fence)
+  {
+    const double x = point.x;
+    const double y = point.y;
+    return (x >= fence.lx) & (x <= fence.hx) &
+      (y >= fence.ly) & (y <= fence.hy);
+  }
+
 private:
   inline std::size_t __stdcall compute_points_size(const Point* start_point,
     const Point* end_point)
@@ -375,6 +737,70 @@ private:
     const std::size_t min_block_size = MIN_BLOCK_SIZE,
     const std::size_t max_block_size = MAX_BLOCK_SIZE);
 
+  void __stdcall build_top_k(node* node);
+
+  void __stdcall summarize_children(node* node);
+
+  // Returns the most bytes its buffers and the arena held at once.
+  std::size_t __stdcall bulk_load(
+    std::vector<Point*>::iterator begin,
+    std::vector<Point*>::iterator end,
+    const std::size_t max_block_size);
+
+  void __stdcall build_sorted(node* node,
+    std::vector<Point*>::iterator begin,
+    std::vector<Point*>::iterator end,
+    std::vector<uint64_t>::const_iterator keys,
+    uint8_t depth,
+    const std::size_t max_block_size);
+
+  template <typename Count_t>
+  void __stdcall query_with_count(const Rect& query_rect,
+    const Count_t count, int32_t& end_i, Point* out_points);
+
+  template <typename Count_t>
+  bool __stdcall visit_node(const node* curr, const Overlap overlap,
+    const DoubleRect& bounds, top_k_buffer<Count_t>& results) const;
+
+  // Returns the most bytes its buffers held at once, the pointer nodes
+  // not included.
+  std::size_t __stdcall build_compact();
+
+  template <typename Count_t>
+  void __stdcall query_compact(const Rect& bounds,
+    top_k_buffer<Count_t>& results) const;
+
+  template <typename Count_t>
+  void __stdcall query_breadth_first(const DoubleRect& bounds,
+    top_k_buffer<Count_t>& results);
+
+  template <typename Count_t>
+  void __stdcall query_best_first(const DoubleRect& bounds,
+    top_k_buffer<Count_t>& results);
+
+  template <typename Count_t>
+  void __stdcall query_rank_merge(const DoubleRect& bounds,
+    top_k_buffer<Count_t>& results);
+
+  void __stdcall prefetch_leaf(const node* curr) const;
+
+  void __stdcall prefetch_leaf(const compact_node& curr) const;
+
+  uint64_t __stdcall partition_children(
+    const node* node,
+    std::vector<Point*>::iterator begin,
+    std::vector<Point*>::iterator end,
+    uint8_t depth,
+    std::vector<Point*>::iterator (&out_quadrants)[5]) const;
+
+  static bool __stdcall fills_one_quadrant(
+    const std::vector<Point*>::iterator (&quadrants)[5],
+    std::size_t count);
+
+  bool __stdcall spans_one_cell(
+    std::vector<Point*>::iterator begin,
+    std::vector<Point*>::iterator end) const;
+
   void __stdcall build_tree(node* node,
     std::vector<Point *>::iterator begin,
     std::vector<Point *>::iterator end,
@@ -384,14 +810,21 @@ private:
 
   void __stdcall print_tree(node* curr);
 
-  void __stdcall destroy_tree(node* curr);
+  node* __stdcall new_node(uint64_t quad_key, const DoubleRect& point_bounds);
+
+  void __stdcall destroy_tree();
 
   void __stdcall size_recursive(node* curr, std::size_t& count) const;
 
+  void __stdcall node_count_recursive(node* curr, std::size_t& count) const;
+
+  std::size_t __stdcall compact_bytes() const;
+
+  std::size_t __stdcall height_recursive(const node* curr) const;
+
+  std::size_t __stdcall compact_height(uint32_t index) const;
+
 private:
-  static void __stdcall get_buckets(std::vector<Point *>::iterator begin,
-    std::vector<Point*>::iterator end, uint8_t depth, std::size_t count,
-    const DoubleRect& global_bounds, Bucket_t& out_buckets);
 
   static std::size_t __stdcall points_to_vector(const Point* point_begin,
     const Point* point_end, std::vector<Point*>& out_vec, quad_tree& t);
@@ -400,6 +833,15 @@ private:
   node* root_;
   DoubleRect global_bounds_;
   std::vector<Point> outliers_;
+  QueryMode query_mode_;
+  std::size_t prefetch_distance_;
+  BuildOptions options_;
+  aligned_vector<compact_node> compact_nodes_;
+  std::vector<Point> point_pool_;
+  soa_points leaf_soa_;
+  task_pool* build_pool_;
+  BuildStats build_stats_;
+  arena node_arena_;
 };
 
 #endif
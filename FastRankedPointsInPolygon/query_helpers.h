@@ -0,0 +1,263 @@
+#ifndef QUERY_HELPERS_H
+#define QUERY_HELPERS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "ipoint_search.h"
+#include "quad_tree.h"
+#include "rect_filter.h"
+#include "soa_points.h"
+#include "top_k_buffer.h"
+
+#include <intrin.h>
+
+// Bounds tests and result insertion shared by the spatial indexes. Every
+// index offers candidates to a top_k_buffer holding at most count points
+// sorted by rank in aligned per thread scratch, and copies them to the
+// caller's out_points once done.
+
+inline bool __stdcall intersect(
+  const DoubleRect& a,
+  const DoubleRect& b)
+{
+  bool ret = true;
+  ret &= a.lx <= b.hx;
+  ret &= a.hx >= b.lx;
+  ret &= a.ly <= b.hy;
+  ret &= a.hy >= b.ly;
+  return ret;
+}
+
+inline bool __stdcall contains(
+  const DoubleRect& outer,
+  const DoubleRect& inner)
+{
+  bool ret = true;
+  ret &= outer.lx <= inner.lx;
+  ret &= outer.hx >= inner.hx;
+  ret &= outer.ly <= inner.ly;
+  ret &= outer.hy >= inner.hy;
+  return ret;
+}
+
+inline Overlap __stdcall classify(
+  const DoubleRect& query,
+  const DoubleRect& node_bounds)
+{
+  Overlap ret = Overlap::Straddling;
+  if (!intersect(query, node_bounds)) {
+    ret = Overlap::Disjoint;
+  } else if (contains(query, node_bounds)) {
+    ret = Overlap::Contained;
+  }
+  return ret;
+}
+
+inline Overlap __stdcall classify(
+  const Rect& query,
+  const Rect& node_bounds)
+{
+  Overlap ret = Overlap::Straddling;
+  if (query.lx > node_bounds.hx || query.hx < node_bounds.lx ||
+    query.ly > node_bounds.hy || query.hy < node_bounds.ly) {
+    ret = Overlap::Disjoint;
+  } else if (query.lx <= node_bounds.lx && query.hx >= node_bounds.hx &&
+    query.ly <= node_bounds.ly && query.hy >= node_bounds.hy) {
+    ret = Overlap::Contained;
+  }
+  return ret;
+}
+
+template <typename Rect_t>
+inline bool __stdcall point_inside(
+  const Point& a,
+  const Rect_t& b)
+{
+  bool ret = true;
+  ret &= a.x >= b.lx;
+  ret &= a.x <= b.hx;
+  ret &= a.y >= b.ly;
+  ret &= a.y <= b.hy;
+  return ret;
+}
+
+constexpr std::size_t CACHE_LINE_SIZE = 64ull;
+
+/// <summary>
+/// Asks for the cache lines holding the <paramref name="bytes"/> bytes from
+/// <paramref name="address"/> without waiting for them, so a traversal can
+/// keep working while the nodes and leaves it visits next are loaded.
+/// </summary>
+inline void prefetch(const void* address, const std::size_t bytes)
+{
+  const char* line = static_cast<const char*>(address);
+  for (std::size_t offset = 0; offset < bytes; offset += CACHE_LINE_SIZE) {
+    _mm_prefetch(line + offset, _MM_HINT_T0);
+  }
+}
+
+/// <summary>
+/// Offers the rank sorted <paramref name="points"/> of a leaf to the
+/// result, stopping at the first point that can no longer make it in.
+/// </summary>
+template <typename Rect_t, typename Count_t>
+inline void insert_leaf_points(
+  const Point* points,
+  const std::size_t size,
+  const Rect_t& bounds,
+  top_k_buffer<Count_t>& results)
+{
+  for (std::size_t i = 0; i < size; ++i) {
+    const Point& point = points[i];
+    if (point.rank > results.threshold()) {
+      break;
+    } else if (point_inside(point, bounds)) {
+      results.offer(point);
+    }
+  }
+}
+
+/// <summary>
+/// Offers the rank sorted <paramref name="points"/> of a sample that lies
+/// entirely inside the query rect, no per point bounds checks needed.
+/// </summary>
+template <typename Count_t>
+inline void insert_contained_points(
+  const Point* points,
+  const std::size_t size,
+  top_k_buffer<Count_t>& results)
+{
+  for (std::size_t i = 0; i < size; ++i) {
+    if (!results.offer(points[i])) {
+      break;
+    }
+  }
+}
+
+/// <summary>
+/// <see cref="insert_leaf_points"/> for a rank sorted leaf stored in
+/// <paramref name="points"/> from <paramref name="offset"/>. Whole blocks
+/// are tested with <see cref="filter_rect_block"/> and only the points that
+/// pass are converted back to <see cref="Point"/>s.
+/// </summary>
+template <typename Count_t>
+inline void insert_leaf_points(
+  const soa_points& points,
+  const std::size_t offset,
+  const std::size_t size,
+  const Rect& bounds,
+  top_k_buffer<Count_t>& results)
+{
+  const int32_t* ranks = points.rank();
+  for (std::size_t block = 0; block < size; block += RECT_FILTER_BLOCK_SIZE) {
+    const std::size_t first = offset + block;
+    if (ranks[first] > results.threshold()) {
+      break;
+    }
+    uint64_t mask = filter_rect_block(points.x() + first,
+      points.y() + first, bounds);
+    const std::size_t remaining = size - block;
+    if (remaining < RECT_FILTER_BLOCK_SIZE) {
+      mask &= (1ull << remaining) - 1ull;
+    }
+    while (mask != 0ull) {
+      unsigned long bit = 0;
+      _BitScanForward64(&bit, mask);
+      mask &= mask - 1ull;
+      if (!results.offer(points.at(first + bit))) {
+        return;
+      }
+    }
+  }
+}
+
+/// <summary>
+/// <see cref="insert_leaf_points"/> for a rank sorted leaf added with
+/// <see cref="soa_points::append_quantized"/> in <paramref name="frame"/>.
+/// The quantized filter yields every point that may be inside
+/// <paramref name="bounds"/> and a second, one step narrower, filter those
+/// that surely are. Only the candidates in between, the ones quantized onto
+/// an edge of <paramref name="bounds"/>, are checked against the floats.
+/// </summary>
+template <typename Count_t>
+inline void insert_quantized_leaf_points(
+  const soa_points& points,
+  const std::size_t offset,
+  const std::size_t size,
+  const Rect& frame,
+  const Rect& bounds,
+  top_k_buffer<Count_t>& results)
+{
+  const double scale_x = soa_points::quantization_scale(frame.lx, frame.hx);
+  const double scale_y = soa_points::quantization_scale(frame.ly, frame.hy);
+  const int32_t lx = soa_points::quantize(bounds.lx, frame.lx, scale_x);
+  const int32_t ly = soa_points::quantize(bounds.ly, frame.ly, scale_y);
+  const int32_t hx = soa_points::quantize(bounds.hx, frame.lx, scale_x);
+  const int32_t hy = soa_points::quantize(bounds.hy, frame.ly, scale_y);
+
+  const QuantizedRect maybe = {
+    soa_points::clamp_quantized(lx), soa_points::clamp_quantized(ly),
+    soa_points::clamp_quantized(hx), soa_points::clamp_quantized(hy)
+  };
+  const QuantizedRect surely = {
+    soa_points::clamp_quantized(lx + 1), soa_points::clamp_quantized(ly + 1),
+    soa_points::clamp_quantized(hx - 1), soa_points::clamp_quantized(hy - 1)
+  };
+  const bool any_surely = lx + 1 <= hx - 1 && ly + 1 <= hy - 1 &&
+    hx - 1 >= 0 && hy - 1 >= 0 && lx + 1 <= soa_points::QUANTIZED_MAX &&
+    ly + 1 <= soa_points::QUANTIZED_MAX;
+
+  const int32_t* ranks = points.rank();
+  const float* x = points.x();
+  const float* y = points.y();
+  for (std::size_t block = 0; block < size; block += RECT_FILTER_BLOCK_SIZE) {
+    const std::size_t first = offset + block;
+    if (ranks[first] > results.threshold()) {
+      break;
+    }
+    uint64_t mask = filter_quantized_block(points.qx() + first,
+      points.qy() + first, maybe);
+    const std::size_t remaining = size - block;
+    if (remaining < RECT_FILTER_BLOCK_SIZE) {
+      mask &= (1ull << remaining) - 1ull;
+    }
+    const uint64_t sure = (any_surely && mask != 0ull) ?
+      filter_quantized_block(points.qx() + first, points.qy() + first,
+        surely) : 0ull;
+    while (mask != 0ull) {
+      unsigned long bit = 0;
+      _BitScanForward64(&bit, mask);
+      mask &= mask - 1ull;
+      const std::size_t i = first + bit;
+      if ((sure >> bit & 1ull) == 0ull && !(x[i] >= bounds.lx &&
+        x[i] <= bounds.hx && y[i] >= bounds.ly && y[i] <= bounds.hy)) {
+        continue;
+      }
+      if (!results.offer(points.at(i))) {
+        return;
+      }
+    }
+  }
+}
+
+/// <summary>
+/// <see cref="insert_contained_points"/> for a rank sorted leaf stored in
+/// <paramref name="points"/> from <paramref name="offset"/>.
+/// </summary>
+template <typename Count_t>
+inline void insert_contained_points(
+  const soa_points& points,
+  const std::size_t offset,
+  const std::size_t size,
+  top_k_buffer<Count_t>& results)
+{
+  for (std::size_t i = offset; i < offset + size; ++i) {
+    if (!results.offer(points.at(i))) {
+      break;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,155 @@
+#include "query_planner.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+__stdcall query_planner::query_planner(
+  const Point* point_begin,
+  const Point* point_end,
+  const std::size_t leaf_size) :
+  bounds_({}),
+  size_(0u),
+  outlier_count_(0u),
+  leaf_size_((std::max)(leaf_size, std::size_t(1))),
+  summed_counts_((GRID_SIZE + 1) * (GRID_SIZE + 1), 0ull)
+{
+  if (point_begin == nullptr || point_end == nullptr ||
+    point_begin == point_end) {
+    return;
+  }
+
+  size_ = std::distance(point_begin, point_end);
+
+  // The histogram covers the points the quad_tree is built from, inside
+  // the same fences and bounds, so an outlier cannot squeeze the rest into
+  // a single cell. The rest are only counted, like its sidecar.
+  DoubleRect fence;
+  quad_tree::compute_outlier_fence(point_begin, point_end, fence);
+  float min_x = +(std::numeric_limits<float>::max)();
+  float min_y = +(std::numeric_limits<float>::max)();
+  float max_x = -(std::numeric_limits<float>::max)();
+  float max_y = -(std::numeric_limits<float>::max)();
+  for (const Point* it = point_begin; it != point_end; ++it) {
+    if (quad_tree::inside_fence(*it, fence)) {
+      min_x = (std::min)(min_x, it->x);
+      min_y = (std::min)(min_y, it->y);
+      max_x = (std::max)(max_x, it->x);
+      max_y = (std::max)(max_y, it->y);
+    } else {
+      ++outlier_count_;
+    }
+  }
+  if (outlier_count_ == size_) {
+    return;
+  }
+  bounds_ = { std::floor(min_x), std::floor(min_y),
+    std::ceil(max_x), std::ceil(max_y) };
+
+  const std::size_t stride = GRID_SIZE + 1;
+  for (const Point* it = point_begin; it != point_end; ++it) {
+    if (!quad_tree::inside_fence(*it, fence)) {
+      continue;
+    }
+    std::size_t i = (std::min)(static_cast<std::size_t>(grid_x(it->x)),
+      GRID_SIZE - 1);
+    std::size_t j = (std::min)(static_cast<std::size_t>(grid_y(it->y)),
+      GRID_SIZE - 1);
+    ++summed_counts_[(j + 1) * stride + (i + 1)];
+  }
+
+  // summed_counts_[j * stride + i] becomes the number of points in the
+  // cells left of column i and below row j.
+  for (std::size_t j = 1; j < stride; ++j) {
+    for (std::size_t i = 1; i < stride; ++i) {
+      summed_counts_[j * stride + i] += summed_counts_[j * stride + i - 1] +
+        summed_counts_[(j - 1) * stride + i] -
+        summed_counts_[(j - 1) * stride + i - 1];
+    }
+  }
+}
+
+double __stdcall query_planner::grid_x(double x) const
+{
+  const double extent = bounds_.hx - bounds_.lx;
+  double ret = extent > 0.0 ? (x - bounds_.lx) / extent * GRID_SIZE :
+    (x >= bounds_.lx ? static_cast<double>(GRID_SIZE) : 0.0);
+  // NaN lands on 0 rather than reaching a cast to std::size_t.
+  return ret > 0.0 ? (std::min)(ret, static_cast<double>(GRID_SIZE)) : 0.0;
+}
+
+double __stdcall query_planner::grid_y(double y) const
+{
+  const double extent = bounds_.hy - bounds_.ly;
+  double ret = extent > 0.0 ? (y - bounds_.ly) / extent * GRID_SIZE :
+    (y >= bounds_.ly ? static_cast<double>(GRID_SIZE) : 0.0);
+  return ret > 0.0 ? (std::min)(ret, static_cast<double>(GRID_SIZE)) : 0.0;
+}
+
+double __stdcall query_planner::cumulative(double gx, double gy) const
+{
+  // Points are spread evenly within a cell, which makes the summed counts
+  // bilinear between the grid corners.
+  const std::size_t stride = GRID_SIZE + 1;
+  const std::size_t i = (std::min)(static_cast<std::size_t>(gx),
+    GRID_SIZE - 1);
+  const std::size_t j = (std::min)(static_cast<std::size_t>(gy),
+    GRID_SIZE - 1);
+  const double fx = gx - i;
+  const double fy = gy - j;
+  const double c00 = static_cast<double>(summed_counts_[j * stride + i]);
+  const double c10 = static_cast<double>(summed_counts_[j * stride + i + 1]);
+  const double c01 = static_cast<double>(
+    summed_counts_[(j + 1) * stride + i]);
+  const double c11 = static_cast<double>(
+    summed_counts_[(j + 1) * stride + i + 1]);
+  return c00 * (1.0 - fx) * (1.0 - fy) + c10 * fx * (1.0 - fy) +
+    c01 * (1.0 - fx) * fy + c11 * fx * fy;
+}
+
+double __stdcall query_planner::estimate(const Rect& rect) const
+{
+  // Written so NaN coordinates fail too.
+  if (outlier_count_ == size_ || !(rect.lx <= rect.hx) ||
+    !(rect.ly <= rect.hy)) {
+    return 0.0;
+  }
+
+  const double lx = grid_x(rect.lx);
+  const double ly = grid_y(rect.ly);
+  const double hx = grid_x(rect.hx);
+  const double hy = grid_y(rect.hy);
+  double ret = cumulative(hx, hy) - cumulative(lx, hy) -
+    cumulative(hx, ly) + cumulative(lx, ly);
+  return (std::max)(ret, 0.0);
+}
+
+QueryPlan __stdcall query_planner::plan(
+  const Rect& rect,
+  const int32_t count) const
+{
+  QueryPlan ret = { QueryStrategy::TreeTraversal, estimate(rect), 0.0, 0.0 };
+
+  const double size = static_cast<double>(size_);
+  const double wanted = static_cast<double>((std::max)(count, 1));
+  const double leaf_size = static_cast<double>(leaf_size_);
+
+  double scanned = size;
+  if (ret.estimated_points >= 1.0) {
+    scanned = (std::min)(size, wanted * size / ret.estimated_points);
+  }
+  ret.scan_cost = SCAN_COST_PER_POINT * scanned;
+
+  const double leaves_inside = (std::max)(ret.estimated_points / leaf_size,
+    1.0);
+  const double visited = (std::min)(size,
+    4.0 * std::sqrt(leaves_inside) * leaf_size +
+    (std::min)(wanted, ret.estimated_points) +
+    static_cast<double>(outlier_count_));
+  ret.tree_cost = TREE_COST_PER_POINT * visited;
+
+  if (ret.scan_cost < ret.tree_cost) {
+    ret.strategy = QueryStrategy::RankScan;
+  }
+  return ret;
+}
@@ -0,0 +1,104 @@
+#ifndef QUERY_PLANNER_H
+#define QUERY_PLANNER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ipoint_search.h"
+#include "quad_tree.h"
+
+/// <summary>
+/// The ways a planned <see cref="SearchContext"/> can answer a search.
+/// </summary>
+enum class QueryStrategy : int32_t {
+  TreeTraversal = 0,
+  RankScan = 1
+};
+
+/// <summary>
+/// The outcome of <see cref="query_planner::plan"/>. Costs are in units of
+/// one point passed through the vectorized rank scan filter.
+/// </summary>
+struct QueryPlan
+{
+  QueryStrategy strategy;
+  double estimated_points;
+  double tree_cost;
+  double scan_cost;
+};
+
+/// <summary>
+/// Picks the cheaper of a quad_tree traversal and a rank ordered scan for
+/// each query. The number of points inside a rect is estimated from a
+/// coarse histogram of the points built at create time: a summed count
+/// table over a <see cref="query_planner::GRID_SIZE"/> squared grid,
+/// interpolated bilinearly within cells. The histogram holds the same
+/// inliers, in the same bounds, as a <see cref="quad_tree"/> built from
+/// the points; outliers are only counted, and a traversal is charged for
+/// scanning all of them.
+///
+/// Assuming ranks do not depend on location, a scan finds count hits
+/// after count / selectivity points. A best first traversal pays for the
+/// leaves the rect edges cut through, about four times the square root of
+/// the number of leaves inside the rect, plus the hits themselves, at a
+/// higher cost per point.
+/// </summary>
+class __declspec(dllexport) query_planner
+{
+public:
+  constexpr static std::size_t GRID_SIZE = 64ull;
+  constexpr static double SCAN_COST_PER_POINT = 1.0;
+  constexpr static double TREE_COST_PER_POINT = 4.0;
+
+  /// <summary>
+  /// Builds the histogram of the points between
+  /// <paramref name="point_begin"/> and <paramref name="point_end"/>.
+  /// </summary>
+  /// <param name="point_begin">
+  /// The first Point in the array of points.
+  /// </param>
+  /// <param name="point_end">
+  /// One address past the end Point in the array of points.
+  /// </param>
+  /// <param name="leaf_size">
+  /// The maximum number of points in a leaf of the tree being planned for.
+  /// </param>
+  __stdcall query_planner(
+    const Point* point_begin,
+    const Point* point_end,
+    const std::size_t leaf_size);
+
+  /// <summary>
+  /// The estimated number of points inside <paramref name="rect"/>,
+  /// outliers left out.
+  /// </summary>
+  /// <param name="rect">The query rect.</param>
+  /// <returns></returns>
+  double __stdcall estimate(const Rect& rect) const;
+
+  /// <summary>
+  /// Estimates both strategies for a query of <paramref name="count"/>
+  /// points inside <paramref name="rect"/> and picks the cheaper one.
+  /// </summary>
+  /// <param name="rect">The query rect.</param>
+  /// <param name="count">The maximum number of points wanted.</param>
+  /// <returns></returns>
+  QueryPlan __stdcall plan(const Rect& rect, const int32_t count) const;
+
+private:
+  double __stdcall grid_x(double x) const;
+
+  double __stdcall grid_y(double y) const;
+
+  double __stdcall cumulative(double gx, double gy) const;
+
+private:
+  DoubleRect bounds_;
+  std::size_t size_;
+  std::size_t outlier_count_;
+  std::size_t leaf_size_;
+  std::vector<uint64_t> summed_counts_;
+};
+
+#endif
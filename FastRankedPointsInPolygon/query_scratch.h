@@ -0,0 +1,69 @@
+#ifndef QUERY_SCRATCH_H
+#define QUERY_SCRATCH_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/// <summary>
+/// An empty vector owned by the calling thread. Its capacity survives
+/// between calls, so a query drawing its traversal queues and result
+/// buffer from here stops allocating once the thread has run a query at
+/// least as large. Every call empties the vector, so a query may hold only
+/// one scratch vector per <typeparamref name="T"/> and
+/// <typeparamref name="Slot"/> at a time.
+/// </summary>
+template <typename T, typename Allocator_t = std::allocator<T>,
+  int32_t Slot = 0>
+inline std::vector<T, Allocator_t>& thread_scratch()
+{
+  thread_local std::vector<T, Allocator_t> scratch;
+  scratch.clear();
+  return scratch;
+}
+
+/// <summary>
+/// The subset of std::priority_queue the traversals use, kept in a
+/// borrowed vector, see <see cref="thread_scratch"/>. With the default
+/// <typeparamref name="Compare_t"/> the lowest element is on top.
+/// </summary>
+template <typename T, typename Compare_t = std::greater<T>>
+class scratch_heap
+{
+public:
+  explicit scratch_heap(std::vector<T>& storage) :
+    storage_(storage)
+  {
+    storage_.clear();
+  }
+
+  bool empty() const
+  {
+    return storage_.empty();
+  }
+
+  const T& top() const
+  {
+    return storage_.front();
+  }
+
+  void push(const T& value)
+  {
+    storage_.push_back(value);
+    std::push_heap(storage_.begin(), storage_.end(), Compare_t());
+  }
+
+  void pop()
+  {
+    std::pop_heap(storage_.begin(), storage_.end(), Compare_t());
+    storage_.pop_back();
+  }
+
+private:
+  std::vector<T>& storage_;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#include "radix_sort.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace
+{
+  constexpr std::size_t DIGIT_BITS = 11ull;
+  constexpr std::size_t RADIX = 1ull << DIGIT_BITS;
+  constexpr std::size_t PASSES = (64ull + DIGIT_BITS - 1) / DIGIT_BITS;
+
+  inline std::size_t digit(uint64_t key, std::size_t pass)
+  {
+    return static_cast<std::size_t>(
+      (key >> (pass * DIGIT_BITS)) & (RADIX - 1ull));
+  }
+
+  // Runs work(chunk) for every chunk, on the pool when there is one.
+  template <typename Work_t>
+  void for_each_chunk(task_pool* pool, std::size_t chunks, Work_t work)
+  {
+    if (pool == nullptr) {
+      for (std::size_t chunk = 0; chunk < chunks; ++chunk) {
+        work(chunk);
+      }
+    } else {
+      task_pool::task_group group;
+      for (std::size_t chunk = 1; chunk < chunks; ++chunk) {
+        pool->run(group, [&work, chunk]()
+        {
+          work(chunk);
+        });
+      }
+      work(0u);
+      pool->wait(group);
+    }
+  }
+}
+
+void __stdcall radix_sort(
+  std::vector<uint64_t>& keys,
+  std::vector<uint32_t>& values,
+  task_pool* pool,
+  std::size_t* peak_bytes)
+{
+  if (keys.size() != values.size()) {
+    throw std::runtime_error(std::string(__FUNCTION__) +
+      " needs one value per key.");
+  }
+
+  if (peak_bytes != nullptr) {
+    *peak_bytes = 0u;
+  }
+  const std::size_t size = keys.size();
+  if (size < 2) {
+    return;
+  }
+  if (pool != nullptr &&
+    (pool->thread_count() < 2 || size < RADIX_SORT_PARALLEL_CUTOFF)) {
+    pool = nullptr;
+  }
+
+  const std::size_t chunks = pool == nullptr ? 1u : pool->thread_count();
+  const std::size_t chunk_size = (size + chunks - 1) / chunks;
+
+  auto chunk_range = [&](std::size_t chunk)
+  {
+    const std::size_t first = (std::min)(chunk * chunk_size, size);
+    return std::make_pair(first, (std::min)(first + chunk_size, size));
+  };
+
+  // One read of the keys counts the digits of every pass, which tells the
+  // passes that can be skipped and, when sorting on one thread, already
+  // are the counts the scatter needs.
+  std::vector<std::size_t> totals(PASSES * RADIX, 0u);
+  {
+    std::vector<std::size_t> chunk_totals(chunks * PASSES * RADIX, 0u);
+    for_each_chunk(pool, chunks, [&](std::size_t chunk)
+    {
+      std::size_t* count = chunk_totals.data() + chunk * PASSES * RADIX;
+      const auto range = chunk_range(chunk);
+      for (std::size_t i = range.first; i < range.second; ++i) {
+        for (std::size_t pass = 0; pass < PASSES; ++pass) {
+          ++count[pass * RADIX + digit(keys[i], pass)];
+        }
+      }
+    });
+    for (std::size_t chunk = 0; chunk < chunks; ++chunk) {
+      for (std::size_t i = 0; i < PASSES * RADIX; ++i) {
+        totals[i] += chunk_totals[chunk * PASSES * RADIX + i];
+      }
+    }
+    if (peak_bytes != nullptr) {
+      *peak_bytes = (totals.capacity() + chunk_totals.capacity()) *
+        sizeof(std::size_t);
+    }
+  }
+
+  std::vector<uint64_t> key_buffer(size);
+  std::vector<uint32_t> value_buffer(size);
+  std::vector<std::size_t> offsets(chunks * RADIX, 0u);
+  if (peak_bytes != nullptr) {
+    *peak_bytes = (std::max)(*peak_bytes,
+      (totals.capacity() + offsets.capacity()) * sizeof(std::size_t) +
+      key_buffer.capacity() * sizeof(uint64_t) +
+      value_buffer.capacity() * sizeof(uint32_t));
+  }
+  for (std::size_t pass = 0; pass < PASSES; ++pass) {
+    const std::size_t* total = totals.data() + pass * RADIX;
+    // Keys agreeing on this digit keep their order, skip the pass.
+    if (total[digit(keys[0], pass)] == size) {
+      continue;
+    }
+
+    // Every earlier pass moved keys between chunks, so their counts are
+    // taken again.
+    if (chunks == 1) {
+      std::copy(total, total + RADIX, offsets.begin());
+    } else {
+      std::fill(offsets.begin(), offsets.end(), 0u);
+      for_each_chunk(pool, chunks, [&](std::size_t chunk)
+      {
+        std::size_t* count = offsets.data() + chunk * RADIX;
+        const auto range = chunk_range(chunk);
+        for (std::size_t i = range.first; i < range.second; ++i) {
+          ++count[digit(keys[i], pass)];
+        }
+      });
+    }
+
+    // Turn the counts into scatter positions, digit major then chunk, so
+    // the scatter stays stable.
+    std::size_t position = 0;
+    for (std::size_t d = 0; d < RADIX; ++d) {
+      for (std::size_t chunk = 0; chunk < chunks; ++chunk) {
+        std::size_t& offset = offsets[chunk * RADIX + d];
+        const std::size_t counted = offset;
+        offset = position;
+        position += counted;
+      }
+    }
+
+    for_each_chunk(pool, chunks, [&](std::size_t chunk)
+    {
+      std::size_t* offset = offsets.data() + chunk * RADIX;
+      const auto range = chunk_range(chunk);
+      for (std::size_t i = range.first; i < range.second; ++i) {
+        const std::size_t to = offset[digit(keys[i], pass)]++;
+        key_buffer[to] = keys[i];
+        value_buffer[to] = values[i];
+      }
+    });
+    keys.swap(key_buffer);
+    values.swap(value_buffer);
+  }
+}
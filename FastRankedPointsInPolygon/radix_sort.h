@@ -0,0 +1,36 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "task_pool.h"
+
+constexpr std::size_t RADIX_SORT_PARALLEL_CUTOFF = 65536ull;
+
+/// <summary>
+/// Stable least significant digit radix sort of <paramref name="keys"/>,
+/// moving <paramref name="values"/> along with them. Eleven bit digits are
+/// used, so 64 bit keys take at most six passes, and passes over a digit
+/// every key shares are skipped. The digits of all passes are counted in a
+/// single read of the keys. With a <paramref name="pool"/> of more than one thread
+/// and at least <see cref="RADIX_SORT_PARALLEL_CUTOFF"/> keys, every pass
+/// is split into one chunk per thread.
+/// </summary>
+/// <param name="keys">The keys to sort.</param>
+/// <param name="values">
+/// The payload of each key, of the same size as <paramref name="keys"/>.
+/// </param>
+/// <param name="pool">Optional threads to sort with.</param>
+/// <param name="peak_bytes">
+/// When not nullptr, set to the most bytes the buffers of the sort held at
+/// once, the keys and values not included.
+/// </param>
+void __stdcall radix_sort(
+  std::vector<uint64_t>& keys,
+  std::vector<uint32_t>& values,
+  task_pool* pool = nullptr,
+  std::size_t* peak_bytes = nullptr);
+
+#endif
@@ -0,0 +1,46 @@
+#include "rank_scan.h"
+
+#include "query_helpers.h"
+
+#include <algorithm>
+#include <vector>
+
+__stdcall rank_scan::rank_scan(
+  const Point* point_begin,
+  const Point* point_end) :
+  size_(0u)
+{
+  if (point_begin == nullptr || point_end == nullptr ||
+    point_begin == point_end) {
+    return;
+  }
+
+  std::vector<Point> sorted(point_begin, point_end);
+  std::stable_sort(sorted.begin(), sorted.end(),
+    [](const Point& lhs, const Point& rhs)
+    {
+      return lhs.rank < rhs.rank;
+    });
+  size_ = sorted.size();
+  points_.append(sorted.data(), sorted.size());
+  points_.finish();
+}
+
+void __stdcall rank_scan::query(
+  const Rect& query_rect,
+  const int32_t count,
+  int32_t& end_i,
+  Point* out_points) const
+{
+  if (size_ == 0u) {
+    return;
+  }
+  top_k_buffer<int32_t> results(count, out_points, end_i);
+  insert_leaf_points(points_, 0u, size_, query_rect, results);
+  end_i = results.copy_to(out_points);
+}
+
+std::size_t __stdcall rank_scan::size() const
+{
+  return size_;
+}
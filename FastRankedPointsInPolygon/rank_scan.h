@@ -0,0 +1,60 @@
+#ifndef RANK_SCAN_H
+#define RANK_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "ipoint_search.h"
+#include "soa_points.h"
+
+/// <summary>
+/// No spatial index at all: every point is kept in one rank sorted
+/// <see cref="soa_points"/> copy and a query scans it from the lowest rank
+/// with <see cref="filter_rect_block"/> until it has count hits. When the
+/// query rect covers a large share of the points the scan stops after a
+/// few blocks, where a tree would still visit most of its leaves.
+/// </summary>
+class __declspec(dllexport) rank_scan
+{
+public:
+  /// <summary>
+  /// Constructor for a rank_scan created from a contiguous block of
+  /// <see cref="Point"/> between the addresses stored by
+  /// <paramref name="point_begin"/> and <paramref name="point_end"/>.
+  /// </summary>
+  /// <param name="point_begin">
+  /// The first Point in the array of points.
+  /// </param>
+  /// <param name="point_end">
+  /// One address past the end Point in the array of points.
+  /// </param>
+  __stdcall rank_scan(
+    const Point* point_begin,
+    const Point* point_end);
+
+  /// <summary>
+  /// Fills <paramref name="out_points"/> with up to
+  /// <paramref name="count"/> points inside <paramref name="query_rect"/>
+  /// sorted by rank, see <see cref="quad_tree::query"/>.
+  /// </summary>
+  /// <param name="query_rect">The query_rect.</param>
+  /// <param name="count">The maximum number of points wanted.</param>
+  /// <param name="end_i">
+  /// Output parameter with the number of points inserted.
+  /// </param>
+  /// <param name="out_points">The sorted points by rank.</param>
+  void __stdcall query(const Rect& query_rect, const int32_t count,
+    int32_t& end_i, Point* out_points) const;
+
+  /// <summary>
+  /// The number of points stored.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall size() const;
+
+private:
+  soa_points points_;
+  std::size_t size_;
+};
+
+#endif
@@ -0,0 +1,224 @@
+#include "rect_filter.h"
+
+#include <intrin.h>
+
+namespace
+{
+  typedef uint64_t(*FilterRectBlock_t)(const float*, const float*,
+    const Rect&);
+  typedef uint64_t(*FilterQuantizedBlock_t)(const uint16_t*,
+    const uint16_t*, const QuantizedRect&);
+
+  uint64_t filter_rect_block_scalar(
+    const float* x,
+    const float* y,
+    const Rect& rect)
+  {
+    uint64_t ret = 0ull;
+    for (std::size_t i = 0; i < RECT_FILTER_BLOCK_SIZE; ++i) {
+      const bool inside = x[i] >= rect.lx && x[i] <= rect.hx &&
+        y[i] >= rect.ly && y[i] <= rect.hy;
+      ret |= static_cast<uint64_t>(inside) << i;
+    }
+    return ret;
+  }
+
+  // The vector kernels compare with ordered predicates so NaN padding
+  // behind the last point of a leaf always fails the test.
+
+  uint64_t filter_rect_block_avx2(
+    const float* x,
+    const float* y,
+    const Rect& rect)
+  {
+    const __m256 lx = _mm256_set1_ps(rect.lx);
+    const __m256 ly = _mm256_set1_ps(rect.ly);
+    const __m256 hx = _mm256_set1_ps(rect.hx);
+    const __m256 hy = _mm256_set1_ps(rect.hy);
+
+    uint64_t ret = 0ull;
+    for (std::size_t i = 0; i < RECT_FILTER_BLOCK_SIZE; i += 8) {
+      const __m256 px = _mm256_load_ps(x + i);
+      const __m256 py = _mm256_load_ps(y + i);
+      __m256 inside = _mm256_and_ps(
+        _mm256_cmp_ps(px, lx, _CMP_GE_OQ),
+        _mm256_cmp_ps(px, hx, _CMP_LE_OQ));
+      inside = _mm256_and_ps(inside, _mm256_cmp_ps(py, ly, _CMP_GE_OQ));
+      inside = _mm256_and_ps(inside, _mm256_cmp_ps(py, hy, _CMP_LE_OQ));
+      ret |= static_cast<uint64_t>(_mm256_movemask_ps(inside)) << i;
+    }
+    return ret;
+  }
+
+  uint64_t filter_rect_block_avx512(
+    const float* x,
+    const float* y,
+    const Rect& rect)
+  {
+    const __m512 lx = _mm512_set1_ps(rect.lx);
+    const __m512 ly = _mm512_set1_ps(rect.ly);
+    const __m512 hx = _mm512_set1_ps(rect.hx);
+    const __m512 hy = _mm512_set1_ps(rect.hy);
+
+    uint64_t ret = 0ull;
+    for (std::size_t i = 0; i < RECT_FILTER_BLOCK_SIZE; i += 16) {
+      const __m512 px = _mm512_load_ps(x + i);
+      const __m512 py = _mm512_load_ps(y + i);
+      __mmask16 inside = _mm512_cmp_ps_mask(px, lx, _CMP_GE_OQ);
+      inside = _mm512_mask_cmp_ps_mask(inside, px, hx, _CMP_LE_OQ);
+      inside = _mm512_mask_cmp_ps_mask(inside, py, ly, _CMP_GE_OQ);
+      inside = _mm512_mask_cmp_ps_mask(inside, py, hy, _CMP_LE_OQ);
+      ret |= static_cast<uint64_t>(inside) << i;
+    }
+    return ret;
+  }
+
+  uint64_t filter_quantized_block_scalar(
+    const uint16_t* qx,
+    const uint16_t* qy,
+    const QuantizedRect& rect)
+  {
+    uint64_t ret = 0ull;
+    for (std::size_t i = 0; i < RECT_FILTER_BLOCK_SIZE; ++i) {
+      const bool inside = qx[i] >= rect.lx && qx[i] <= rect.hx &&
+        qy[i] >= rect.ly && qy[i] <= rect.hy;
+      ret |= static_cast<uint64_t>(inside) << i;
+    }
+    return ret;
+  }
+
+  // AVX2 has no unsigned 16 bit compare, so a >= b is tested as
+  // max(a, b) == a and a <= b as min(a, b) == a.
+  inline __m256i inside_epu16(__m256i q, __m256i lo, __m256i hi)
+  {
+    return _mm256_and_si256(
+      _mm256_cmpeq_epi16(_mm256_max_epu16(q, lo), q),
+      _mm256_cmpeq_epi16(_mm256_min_epu16(q, hi), q));
+  }
+
+  uint64_t filter_quantized_block_avx2(
+    const uint16_t* qx,
+    const uint16_t* qy,
+    const QuantizedRect& rect)
+  {
+    const __m256i lx = _mm256_set1_epi16(static_cast<short>(rect.lx));
+    const __m256i ly = _mm256_set1_epi16(static_cast<short>(rect.ly));
+    const __m256i hx = _mm256_set1_epi16(static_cast<short>(rect.hx));
+    const __m256i hy = _mm256_set1_epi16(static_cast<short>(rect.hy));
+
+    uint64_t ret = 0ull;
+    for (std::size_t i = 0; i < RECT_FILTER_BLOCK_SIZE; i += 32) {
+      const __m256i* px = reinterpret_cast<const __m256i*>(qx + i);
+      const __m256i* py = reinterpret_cast<const __m256i*>(qy + i);
+      const __m256i lower = _mm256_and_si256(
+        inside_epu16(_mm256_loadu_si256(px), lx, hx),
+        inside_epu16(_mm256_loadu_si256(py), ly, hy));
+      const __m256i upper = _mm256_and_si256(
+        inside_epu16(_mm256_loadu_si256(px + 1), lx, hx),
+        inside_epu16(_mm256_loadu_si256(py + 1), ly, hy));
+      // Packing works per 128 bit lane, the permute restores lane order.
+      const __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packs_epi16(lower, upper), 0xD8);
+      ret |= static_cast<uint64_t>(
+        static_cast<uint32_t>(_mm256_movemask_epi8(packed))) << i;
+    }
+    return ret;
+  }
+
+  uint64_t filter_quantized_block_avx512(
+    const uint16_t* qx,
+    const uint16_t* qy,
+    const QuantizedRect& rect)
+  {
+    const __m512i lx = _mm512_set1_epi16(static_cast<short>(rect.lx));
+    const __m512i ly = _mm512_set1_epi16(static_cast<short>(rect.ly));
+    const __m512i hx = _mm512_set1_epi16(static_cast<short>(rect.hx));
+    const __m512i hy = _mm512_set1_epi16(static_cast<short>(rect.hy));
+
+    uint64_t ret = 0ull;
+    for (std::size_t i = 0; i < RECT_FILTER_BLOCK_SIZE; i += 32) {
+      const __m512i px = _mm512_loadu_si512(qx + i);
+      const __m512i py = _mm512_loadu_si512(qy + i);
+      __mmask32 inside = _mm512_cmp_epu16_mask(px, lx, _MM_CMPINT_NLT);
+      inside = _mm512_mask_cmp_epu16_mask(inside, px, hx, _MM_CMPINT_LE);
+      inside = _mm512_mask_cmp_epu16_mask(inside, py, ly, _MM_CMPINT_NLT);
+      inside = _mm512_mask_cmp_epu16_mask(inside, py, hy, _MM_CMPINT_LE);
+      ret |= static_cast<uint64_t>(inside) << i;
+    }
+    return ret;
+  }
+
+  SimdLevel clamp_level(SimdLevel level)
+  {
+    const SimdLevel best = cpu_features::best_simd_level();
+    return static_cast<int32_t>(level) > static_cast<int32_t>(best) ?
+      best : level;
+  }
+
+  FilterRectBlock_t kernel_for(SimdLevel level)
+  {
+    FilterRectBlock_t ret = filter_rect_block_scalar;
+    switch (level) {
+    case SimdLevel::Avx512:
+      ret = filter_rect_block_avx512;
+      break;
+    case SimdLevel::Avx2:
+      ret = filter_rect_block_avx2;
+      break;
+    default:
+      break;
+    }
+    return ret;
+  }
+
+  FilterQuantizedBlock_t quantized_kernel_for(SimdLevel level)
+  {
+    FilterQuantizedBlock_t ret = filter_quantized_block_scalar;
+    switch (level) {
+    case SimdLevel::Avx512:
+      // 16 bit lane compares need AVX-512BW on top of AVX-512F.
+      ret = cpu_features::get().avx512bw_ ?
+        filter_quantized_block_avx512 : filter_quantized_block_avx2;
+      break;
+    case SimdLevel::Avx2:
+      ret = filter_quantized_block_avx2;
+      break;
+    default:
+      break;
+    }
+    return ret;
+  }
+
+  SimdLevel g_level = cpu_features::best_simd_level();
+  FilterRectBlock_t g_kernel = kernel_for(g_level);
+  FilterQuantizedBlock_t g_quantized_kernel = quantized_kernel_for(g_level);
+}
+
+uint64_t __stdcall filter_rect_block(
+  const float* x,
+  const float* y,
+  const Rect& rect)
+{
+  return g_kernel(x, y, rect);
+}
+
+uint64_t __stdcall filter_quantized_block(
+  const uint16_t* qx,
+  const uint16_t* qy,
+  const QuantizedRect& rect)
+{
+  return g_quantized_kernel(qx, qy, rect);
+}
+
+SimdLevel __stdcall rect_filter_level()
+{
+  return g_level;
+}
+
+SimdLevel __stdcall set_rect_filter_level(SimdLevel level)
+{
+  g_level = clamp_level(level);
+  g_kernel = kernel_for(g_level);
+  g_quantized_kernel = quantized_kernel_for(g_level);
+  return g_level;
+}
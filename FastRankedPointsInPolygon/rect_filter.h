@@ -0,0 +1,73 @@
+#ifndef RECT_FILTER_H
+#define RECT_FILTER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cpu_features.h"
+#include "ipoint_search.h"
+
+constexpr std::size_t RECT_FILTER_BLOCK_SIZE = 64ull;
+
+/// <summary>
+/// Tests <see cref="RECT_FILTER_BLOCK_SIZE"/> consecutive coordinates
+/// against <paramref name="rect"/>, bounds inclusive. Bit i of the result is
+/// set when (x[i], y[i]) lies inside the rect. <paramref name="x"/> and
+/// <paramref name="y"/> must be 64 byte aligned and readable for a whole
+/// block. NaN coordinates never pass.
+/// </summary>
+/// <param name="x">The x coordinates of the block.</param>
+/// <param name="y">The y coordinates of the block.</param>
+/// <param name="rect">The query rect.</param>
+/// <returns>One bit per coordinate pair.</returns>
+uint64_t __stdcall filter_rect_block(
+  const float* x,
+  const float* y,
+  const Rect& rect);
+
+/// <summary>
+/// An inclusive range of quantized coordinates, see
+/// <see cref="soa_points::quantize"/>.
+/// </summary>
+struct QuantizedRect
+{
+  uint16_t lx;
+  uint16_t ly;
+  uint16_t hx;
+  uint16_t hy;
+};
+
+/// <summary>
+/// <see cref="filter_rect_block"/> for quantized coordinates. Bit i of the
+/// result is set when (qx[i], qy[i]) lies inside <paramref name="rect"/>.
+/// The arrays need no particular alignment but must be readable for a whole
+/// block.
+/// </summary>
+/// <param name="qx">The quantized x coordinates of the block.</param>
+/// <param name="qy">The quantized y coordinates of the block.</param>
+/// <param name="rect">The quantized query range.</param>
+/// <returns>One bit per coordinate pair.</returns>
+uint64_t __stdcall filter_quantized_block(
+  const uint16_t* qx,
+  const uint16_t* qy,
+  const QuantizedRect& rect);
+
+/// <summary>
+/// The kernel used by <see cref="filter_rect_block"/> and
+/// <see cref="filter_quantized_block"/>. Picked from
+/// <see cref="cpu_features::best_simd_level"/> when the DLL is loaded.
+/// </summary>
+/// <returns></returns>
+SimdLevel __stdcall rect_filter_level();
+
+/// <summary>
+/// Forces the kernels used by <see cref="filter_rect_block"/> and
+/// <see cref="filter_quantized_block"/>, clamped to what the current CPU
+/// supports. Meant for testing and benchmarking the
+/// kernels against each other.
+/// </summary>
+/// <param name="level">The widest kernel to use.</param>
+/// <returns>The kernel actually selected.</returns>
+SimdLevel __stdcall set_rect_filter_level(SimdLevel level);
+
+#endif
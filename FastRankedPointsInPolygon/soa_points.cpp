@@ -0,0 +1,121 @@
+#include "soa_points.h"
+
+#include <limits>
+
+std::size_t __stdcall soa_points::append(const Point* begin, std::size_t size)
+{
+  const std::size_t offset = (x_.size() + LANE_ALIGNMENT - 1) /
+    LANE_ALIGNMENT * LANE_ALIGNMENT;
+  pad_to(offset);
+  for (std::size_t i = 0; i < size; ++i) {
+    x_.push_back(begin[i].x);
+    y_.push_back(begin[i].y);
+    rank_.push_back(begin[i].rank);
+    id_.push_back(begin[i].id);
+  }
+  return offset;
+}
+
+std::size_t __stdcall soa_points::append_quantized(
+  const Point* begin,
+  std::size_t size,
+  const Rect& frame)
+{
+  const std::size_t offset = append(begin, size);
+  qx_.resize(x_.size(), 0u);
+  qy_.resize(y_.size(), 0u);
+  const double scale_x = quantization_scale(frame.lx, frame.hx);
+  const double scale_y = quantization_scale(frame.ly, frame.hy);
+  for (std::size_t i = 0; i < size; ++i) {
+    qx_[offset + i] = clamp_quantized(
+      quantize(begin[i].x, frame.lx, scale_x));
+    qy_[offset + i] = clamp_quantized(
+      quantize(begin[i].y, frame.ly, scale_y));
+  }
+  return offset;
+}
+
+void __stdcall soa_points::reserve(std::size_t size, bool quantized)
+{
+  x_.reserve(size);
+  y_.reserve(size);
+  rank_.reserve(size);
+  id_.reserve(size);
+  if (quantized) {
+    qx_.reserve(size);
+    qy_.reserve(size);
+  }
+}
+
+void __stdcall soa_points::finish()
+{
+  const std::size_t offset = (x_.size() + LANE_ALIGNMENT - 1) /
+    LANE_ALIGNMENT * LANE_ALIGNMENT;
+  pad_to(offset + BLOCK_SIZE);
+  x_.shrink_to_fit();
+  y_.shrink_to_fit();
+  rank_.shrink_to_fit();
+  id_.shrink_to_fit();
+  qx_.shrink_to_fit();
+  qy_.shrink_to_fit();
+}
+
+const float* __stdcall soa_points::x() const
+{
+  return x_.data();
+}
+
+const float* __stdcall soa_points::y() const
+{
+  return y_.data();
+}
+
+const int32_t* __stdcall soa_points::rank() const
+{
+  return rank_.data();
+}
+
+const uint16_t* __stdcall soa_points::qx() const
+{
+  return qx_.empty() ? nullptr : qx_.data();
+}
+
+const uint16_t* __stdcall soa_points::qy() const
+{
+  return qy_.empty() ? nullptr : qy_.data();
+}
+
+bool __stdcall soa_points::is_quantized() const
+{
+  return !qx_.empty();
+}
+
+bool __stdcall soa_points::empty() const
+{
+  return x_.empty();
+}
+
+std::size_t __stdcall soa_points::size() const
+{
+  return x_.size();
+}
+
+std::size_t __stdcall soa_points::capacity_bytes() const
+{
+  return x_.capacity() * sizeof(float) + y_.capacity() * sizeof(float) +
+    rank_.capacity() * sizeof(int32_t) + id_.capacity() * sizeof(int8_t) +
+    qx_.capacity() * sizeof(uint16_t) + qy_.capacity() * sizeof(uint16_t);
+}
+
+void __stdcall soa_points::pad_to(std::size_t size)
+{
+  const float nan = (std::numeric_limits<float>::quiet_NaN)();
+  x_.resize(size, nan);
+  y_.resize(size, nan);
+  rank_.resize(size, (std::numeric_limits<int32_t>::max)());
+  id_.resize(size, 0);
+  if (!qx_.empty()) {
+    qx_.resize(size, 0u);
+    qy_.resize(size, 0u);
+  }
+}
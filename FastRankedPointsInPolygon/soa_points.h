@@ -0,0 +1,157 @@
+#ifndef SOA_POINTS_H
+#define SOA_POINTS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "aligned_allocator.h"
+#include "ipoint_search.h"
+
+/// <summary>
+/// A structure of arrays copy of <see cref="Point"/>s. Coordinates, ranks
+/// and ids live in separate 64 byte aligned arrays so that filters can load
+/// many coordinates per instruction. Every appended run of points starts on
+/// a <see cref="soa_points::LANE_ALIGNMENT"/> boundary and the arrays are
+/// padded so that a whole <see cref="soa_points::BLOCK_SIZE"/> block can be
+/// read from any run start. Padding has NaN coordinates so it never lies
+/// inside a rect. Optionally every coordinate is also kept quantized to 16
+/// bits within the bounds of its run, see
+/// <see cref="soa_points::append_quantized"/>.
+/// </summary>
+class __declspec(dllexport) soa_points
+{
+public:
+  constexpr static std::size_t LANE_ALIGNMENT = 16ull;
+  constexpr static std::size_t BLOCK_SIZE = 64ull;
+  constexpr static int32_t QUANTIZED_MAX = 0xFFFF;
+
+  /// <summary>
+  /// Copies <paramref name="size"/> points to the end of the arrays.
+  /// </summary>
+  /// <param name="begin">The first point to copy.</param>
+  /// <param name="size">The number of points to copy.</param>
+  /// <returns>The index of the first copied point.</returns>
+  std::size_t __stdcall append(const Point* begin, std::size_t size);
+
+  /// <summary>
+  /// <see cref="soa_points::append"/> that also stores each coordinate
+  /// quantized to 16 bits within <paramref name="frame"/>, see
+  /// <see cref="soa_points::quantize"/>. <paramref name="frame"/> must
+  /// contain every appended point. Either every run is quantized or none.
+  /// </summary>
+  /// <param name="begin">The first point to copy.</param>
+  /// <param name="size">The number of points to copy.</param>
+  /// <param name="frame">The bounds the coordinates are quantized in.</param>
+  /// <returns>The index of the first copied point.</returns>
+  std::size_t __stdcall append_quantized(const Point* begin,
+    std::size_t size, const Rect& frame);
+
+  /// <summary>
+  /// The scale mapping an extent of <paramref name="lower"/> to
+  /// <paramref name="upper"/> onto [0, <see cref="QUANTIZED_MAX"/>].
+  /// </summary>
+  static inline double quantization_scale(float lower, float upper)
+  {
+    const double extent = static_cast<double>(upper) - lower;
+    return extent > 0.0 ? QUANTIZED_MAX / extent : 0.0;
+  }
+
+  /// <summary>
+  /// floor((<paramref name="value"/> - <paramref name="origin"/>) *
+  /// <paramref name="scale"/>) clamped to [-1, QUANTIZED_MAX + 1]. The
+  /// mapping never decreases, so comparing quantized values is a
+  /// conservative stand in for comparing the floats: a point quantized
+  /// strictly inside a quantized range lies inside the float range.
+  /// </summary>
+  static inline int32_t quantize(float value, float origin, double scale)
+  {
+    const double q = std::floor((static_cast<double>(value) - origin) *
+      scale);
+    return static_cast<int32_t>((std::min)((std::max)(q, -1.0),
+      QUANTIZED_MAX + 1.0));
+  }
+
+  /// <summary>
+  /// Clamps the result of <see cref="soa_points::quantize"/> to the stored
+  /// 16 bit range.
+  /// </summary>
+  static inline uint16_t clamp_quantized(int32_t q)
+  {
+    return static_cast<uint16_t>((std::min)((std::max)(q, 0), QUANTIZED_MAX));
+  }
+
+  /// <summary>
+  /// Reserves room for <paramref name="size"/> points, padding included, so
+  /// the appends do not reallocate.
+  /// </summary>
+  /// <param name="size">The size of the arrays after finish.</param>
+  /// <param name="quantized">
+  /// Whether the points are appended with append_quantized.
+  /// </param>
+  void __stdcall reserve(std::size_t size, bool quantized);
+
+  /// <summary>
+  /// Pads the arrays so a full block can be read from the last run and
+  /// releases spare capacity. Call once after the last append.
+  /// </summary>
+  void __stdcall finish();
+
+  /// <summary>
+  /// Converts the entry at <paramref name="index"/> back to a
+  /// <see cref="Point"/>.
+  /// </summary>
+  inline Point at(std::size_t index) const
+  {
+    return Point{ id_[index], rank_[index], x_[index], y_[index] };
+  }
+
+  const float* __stdcall x() const;
+
+  const float* __stdcall y() const;
+
+  const int32_t* __stdcall rank() const;
+
+  /// <summary>
+  /// The quantized x coordinates, null unless every run was added with
+  /// <see cref="soa_points::append_quantized"/>.
+  /// </summary>
+  /// <returns></returns>
+  const uint16_t* __stdcall qx() const;
+
+  /// <summary>
+  /// The quantized y coordinates, see <see cref="soa_points::qx"/>.
+  /// </summary>
+  /// <returns></returns>
+  const uint16_t* __stdcall qy() const;
+
+  bool __stdcall is_quantized() const;
+
+  bool __stdcall empty() const;
+
+  /// <summary>
+  /// The number of entries including alignment padding.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall size() const;
+
+  /// <summary>
+  /// The number of bytes reserved by the arrays.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall capacity_bytes() const;
+
+private:
+  void __stdcall pad_to(std::size_t size);
+
+private:
+  aligned_vector<float> x_;
+  aligned_vector<float> y_;
+  aligned_vector<int32_t> rank_;
+  aligned_vector<int8_t> id_;
+  aligned_vector<uint16_t> qx_;
+  aligned_vector<uint16_t> qy_;
+};
+
+#endif
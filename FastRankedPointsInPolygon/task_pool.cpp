@@ -0,0 +1,141 @@
+#include "task_pool.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace
+{
+  thread_local const task_pool* tl_pool = nullptr;
+  thread_local std::size_t tl_queue = 0u;
+}
+
+task_pool::task_group::task_group() :
+  pending_(0u)
+{
+}
+
+__stdcall task_pool::task_pool(std::size_t thread_count) :
+  stop_(false),
+  queued_(0u)
+{
+  if (thread_count == 0) {
+    thread_count = (std::max)(std::thread::hardware_concurrency(), 1u);
+  }
+
+  for (std::size_t i = 0; i < thread_count; ++i) {
+    queues_.emplace_back(new worker_queue());
+  }
+  // Queue 0 belongs to whichever thread calls wait.
+  for (std::size_t i = 1; i < thread_count; ++i) {
+    threads_.emplace_back(&task_pool::worker_loop, this, i);
+  }
+}
+
+__stdcall task_pool::~task_pool()
+{
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void __stdcall task_pool::run(task_group& group, std::function<void()> task)
+{
+  ++group.pending_;
+  worker_queue& queue = *queues_[current_queue()];
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex_);
+    queue.tasks_.emplace_back(
+      [&group, task]()
+      {
+        try {
+          task();
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(group.error_mutex_);
+          if (!group.error_) {
+            group.error_ = std::current_exception();
+          }
+        }
+        --group.pending_;
+      });
+  }
+  ++queued_;
+  wake_.notify_one();
+}
+
+void __stdcall task_pool::wait(task_group& group)
+{
+  const std::size_t self = current_queue();
+  while (group.pending_ != 0u) {
+    if (!try_run_one(self)) {
+      std::this_thread::yield();
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(group.error_mutex_);
+  if (group.error_) {
+    std::exception_ptr error = group.error_;
+    group.error_ = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+std::size_t __stdcall task_pool::thread_count() const
+{
+  return queues_.size();
+}
+
+std::size_t __stdcall task_pool::current_queue() const
+{
+  return tl_pool == this ? tl_queue : 0u;
+}
+
+bool __stdcall task_pool::try_run_one(std::size_t self)
+{
+  std::function<void()> task;
+  {
+    worker_queue& own = *queues_[self];
+    std::lock_guard<std::mutex> lock(own.mutex_);
+    if (!own.tasks_.empty()) {
+      task = std::move(own.tasks_.back());
+      own.tasks_.pop_back();
+    }
+  }
+
+  for (std::size_t i = 1; !task && i < queues_.size(); ++i) {
+    worker_queue& victim = *queues_[(self + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex_);
+    if (!victim.tasks_.empty()) {
+      task = std::move(victim.tasks_.front());
+      victim.tasks_.pop_front();
+    }
+  }
+
+  if (!task) {
+    return false;
+  }
+  --queued_;
+  task();
+  return true;
+}
+
+void __stdcall task_pool::worker_loop(std::size_t self)
+{
+  tl_pool = this;
+  tl_queue = self;
+  while (!stop_) {
+    if (!try_run_one(self)) {
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      wake_.wait_for(lock, std::chrono::milliseconds(1),
+        [this]()
+        {
+          return stop_ || queued_ != 0u;
+        });
+    }
+  }
+  tl_pool = nullptr;
+}
@@ -0,0 +1,102 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// A fork join pool of worker threads with one task deque per thread.
+/// Threads push and pop their own tasks at the back of their deque and
+/// steal from the front of the others' when they run dry, so large
+/// subtrees spread over the pool while small ones stay on the thread that
+/// made them. A thread waiting on a <see cref="task_pool::task_group"/>
+/// keeps running tasks instead of blocking, which makes nested waits safe.
+/// </summary>
+class __declspec(dllexport) task_pool
+{
+public:
+  /// <summary>
+  /// Tasks whose completion can be waited on together. The first exception
+  /// thrown by a task of the group is rethrown by
+  /// <see cref="task_pool::wait"/>.
+  /// </summary>
+  class task_group
+  {
+  public:
+    task_group();
+
+  private:
+    friend class task_pool;
+
+    std::atomic<std::size_t> pending_;
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
+  };
+
+  /// <summary>
+  /// Starts <paramref name="thread_count"/> - 1 worker threads. The thread
+  /// calling <see cref="task_pool::wait"/> is the last worker. 0 uses
+  /// std::thread::hardware_concurrency.
+  /// </summary>
+  /// <param name="thread_count">The number of threads running tasks.</param>
+  explicit __stdcall task_pool(std::size_t thread_count);
+
+  /// <summary>
+  /// Stops and joins the worker threads. Every group must have been waited
+  /// on.
+  /// </summary>
+  __stdcall ~task_pool();
+
+  task_pool(const task_pool&) = delete;
+
+  task_pool& operator=(const task_pool&) = delete;
+
+  /// <summary>
+  /// Queues <paramref name="task"/> as part of <paramref name="group"/> on
+  /// the deque of the calling thread.
+  /// </summary>
+  void __stdcall run(task_group& group, std::function<void()> task);
+
+  /// <summary>
+  /// Runs queued tasks until every task of <paramref name="group"/> has
+  /// finished.
+  /// </summary>
+  void __stdcall wait(task_group& group);
+
+  /// <summary>
+  /// The number of threads running tasks, including the waiting thread.
+  /// </summary>
+  /// <returns></returns>
+  std::size_t __stdcall thread_count() const;
+
+private:
+  struct worker_queue
+  {
+    std::mutex mutex_;
+    std::deque<std::function<void()>> tasks_;
+  };
+
+  std::size_t __stdcall current_queue() const;
+
+  bool __stdcall try_run_one(std::size_t self);
+
+  void __stdcall worker_loop(std::size_t self);
+
+private:
+  std::vector<std::unique_ptr<worker_queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<bool> stop_;
+  std::atomic<std::size_t> queued_;
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+};
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef TOP_K_BUFFER_H
+#define TOP_K_BUFFER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "aligned_allocator.h"
+#include "ipoint_search.h"
+#include "query_scratch.h"
+
+#include <intrin.h>
+
+/// <summary>
+/// A result count known at compile time. Used as the Count_t of a
+/// <see cref="top_k_buffer"/> in place of an int32_t, the capacity and the
+/// number of rank blocks compared per insert become constants.
+/// </summary>
+template <int32_t K>
+struct FixedCount
+{
+  static_assert(K > 0, "FixedCount needs room for at least one point.");
+
+  constexpr operator int32_t() const
+  {
+    return K;
+  }
+};
+
+/// <summary>
+/// The lowest ranked points offered to it, at most a capacity of them, kept
+/// sorted by rank. Ranks live in their own 64 byte aligned array padded
+/// with the largest rank to a whole number of
+/// <see cref="top_k_buffer::LANES"/> wide blocks, so the insertion position
+/// is the number of held ranks below the new one, counted with SSE2
+/// compares over whole blocks rather than a binary search. The rank a point
+/// must not exceed to get in is kept in
+/// <see cref="top_k_buffer::threshold"/> rather than read back from the
+/// buffer. Points are shifted within an aligned array of their own and
+/// written to the caller once, by <see cref="top_k_buffer::copy_to"/>. Both
+/// arrays are the calling thread's <see cref="thread_scratch"/>, so only
+/// one buffer per thread may be alive at a time.
+/// </summary>
+template <typename Count_t>
+class top_k_buffer
+{
+public:
+  constexpr static int32_t LANES = 4;
+
+  /// <summary>
+  /// Constructor for a buffer starting from the results a query is
+  /// continuing from.
+  /// </summary>
+  /// <param name="capacity">The most points kept.</param>
+  /// <param name="held_points">The results so far, in any order.</param>
+  /// <param name="held">The number of points in held_points.</param>
+  top_k_buffer(const Count_t capacity, const Point* held_points,
+    const int32_t held) :
+    capacity_(capacity),
+    size_(0),
+    threshold_((std::numeric_limits<int32_t>::max)()),
+    ranks_(thread_scratch<int32_t, aligned_allocator<int32_t>>()),
+    points_(thread_scratch<Point, aligned_allocator<Point>>())
+  {
+    ranks_.resize(padded(capacity), (std::numeric_limits<int32_t>::max)());
+    points_.resize(static_cast<std::size_t>(static_cast<int32_t>(capacity)));
+    for (int32_t i = 0; i < held; ++i) {
+      offer(held_points[i]);
+    }
+  }
+
+  top_k_buffer(const top_k_buffer&) = delete;
+
+  top_k_buffer& operator=(const top_k_buffer&) = delete;
+
+  /// <summary>
+  /// The largest rank that can still get in: the last held rank once the
+  /// buffer is full, the largest int32_t until then.
+  /// </summary>
+  int32_t threshold() const
+  {
+    return threshold_;
+  }
+
+  int32_t size() const
+  {
+    return size_;
+  }
+
+  Count_t capacity() const
+  {
+    return capacity_;
+  }
+
+  /// <summary>
+  /// Inserts <paramref name="point"/> in rank order, ahead of any held
+  /// point of equal rank, dropping the highest ranked point of a full
+  /// buffer.
+  /// </summary>
+  /// <returns>
+  /// false if <paramref name="point"/> ranks above
+  /// <see cref="top_k_buffer::threshold"/> and was not inserted.
+  /// </returns>
+  bool offer(const Point& point)
+  {
+    if (point.rank > threshold_) {
+      return false;
+    }
+
+    const int32_t at = count_below(point.rank);
+    const int32_t capacity = capacity_;
+    const int32_t last = size_ < capacity ? size_ : capacity - 1;
+    const std::size_t moved = static_cast<std::size_t>(last - at);
+    std::memmove(ranks_.data() + at + 1, ranks_.data() + at,
+      moved * sizeof(int32_t));
+    std::memmove(points_.data() + at + 1, points_.data() + at,
+      moved * sizeof(Point));
+    ranks_[at] = point.rank;
+    points_[at] = point;
+    size_ = last + 1;
+    if (size_ == capacity) {
+      threshold_ = ranks_[capacity - 1];
+    }
+    return true;
+  }
+
+  /// <summary>
+  /// Copies the held points, lowest rank first, to
+  /// <paramref name="out_points"/>.
+  /// </summary>
+  /// <returns>The number of points copied.</returns>
+  int32_t copy_to(Point* out_points) const
+  {
+    std::copy(points_.data(), points_.data() + size_, out_points);
+    return size_;
+  }
+
+private:
+  static std::size_t padded(const Count_t capacity)
+  {
+    const std::size_t lanes = static_cast<std::size_t>(LANES);
+    return (static_cast<std::size_t>(static_cast<int32_t>(capacity)) +
+      lanes - 1u) / lanes * lanes;
+  }
+
+  // The blocks holding every held rank.
+  static int32_t blocks_to_compare(const int32_t size, const int32_t)
+  {
+    return (size + LANES - 1) / LANES;
+  }
+
+  // Every block of a fixed capacity, a constant trip count the compiler
+  // unrolls. The blocks past size only hold padding.
+  template <int32_t K>
+  constexpr static int32_t blocks_to_compare(const int32_t,
+    const FixedCount<K>)
+  {
+    return (K + LANES - 1) / LANES;
+  }
+
+  // The number of held ranks strictly below rank. Padding holds the
+  // largest rank, which nothing is below, so whole blocks are compared.
+  int32_t count_below(const int32_t rank) const
+  {
+    const __m128i key = _mm_set1_epi32(rank);
+    __m128i below = _mm_setzero_si128();
+    const int32_t blocks = blocks_to_compare(size_, capacity_);
+    const __m128i* ranks = reinterpret_cast<const __m128i*>(ranks_.data());
+    for (int32_t block = 0; block < blocks; ++block) {
+      // Lanes below the key compare to -1, subtracting counts them.
+      below = _mm_sub_epi32(below,
+        _mm_cmpgt_epi32(key, _mm_load_si128(ranks + block)));
+    }
+    below = _mm_add_epi32(below, _mm_shuffle_epi32(below, 0x4E));
+    below = _mm_add_epi32(below, _mm_shuffle_epi32(below, 0xB1));
+    return _mm_cvtsi128_si32(below);
+  }
+
+private:
+  const Count_t capacity_;
+  int32_t size_;
+  int32_t threshold_;
+  std::vector<int32_t, aligned_allocator<int32_t>>& ranks_;
+  std::vector<Point, aligned_allocator<Point>>& points_;
+};
+
+#endif
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <crtdbg.h>
 
+#include "bit_kernels_bench.h"
+#include "prefetch_bench.h"
 #include "churchill_data.h"
 
 #include <point_search.h>
@@ -100,6 +102,12 @@ CLI loadCommandLine(
   if (argc < 3) {
         std::cerr << "Usage: TestFastRankedPointsInPolygon "
       << "--dlls [comma seperated list of dll names no spaces!!!]"
+      << std::endl
+      << "       TestFastRankedPointsInPolygon "
+      << "--bench-bit-kernels [number of values]"
+      << std::endl
+      << "       TestFastRankedPointsInPolygon "
+      << "--bench-prefetch [number of points]"
       << std::endl;
     ret.success_ = false;
   } else {
@@ -391,6 +399,16 @@ int main(int argc, char *argv[])
 
   srand(time(nullptr));
 
+  if (argc >= 2 && std::string(argv[1]) == "--bench-bit-kernels") {
+    std::size_t count = (argc >= 3) ? std::stoull(argv[2]) : 10000000ull;
+    return run_bit_kernels_bench(count) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (argc >= 2 && std::string(argv[1]) == "--bench-prefetch") {
+    std::size_t count = (argc >= 3) ? std::stoull(argv[2]) : 2000000ull;
+    return run_prefetch_bench(count) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   CLI cli = loadCommandLine(argc, argv);
   if (cli.success_) {
 
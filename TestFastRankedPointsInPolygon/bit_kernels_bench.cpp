@@ -0,0 +1,172 @@
+#include "bit_kernels_bench.h"
+
+#include <bit_kernels.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  // The implementations quad_tree used before bit_kernels, kept as the
+  // baseline every kernel is measured against.
+  uint64_t legacy_only_msb64_on(uint64_t x)
+  {
+    x |= (x >> 1);
+    x |= (x >> 2);
+    x |= (x >> 4);
+    x |= (x >> 8);
+    x |= (x >> 16);
+    x |= (x >> 32);
+    return x & ~(x >> 1ull);
+  }
+
+  int32_t legacy_msb64(uint64_t x)
+  {
+    if (x == 0ull) {
+      return -1;
+    }
+    x = legacy_only_msb64_on(x);
+    if (x & 0x8000000000000000ull) {
+      return 63;
+    }
+    uint64_t mask = 0x0000000080000000ull;
+    uint64_t shift = 32ull;
+    int32_t depth = 31;
+    while (shift != 0) {
+      shift /= 2;
+      if (x > mask) {
+        mask <<= shift;
+        depth += static_cast<int32_t>(shift);
+      } else if (x < mask) {
+        mask >>= shift;
+        depth -= static_cast<int32_t>(shift);
+      } else {
+        break;
+      }
+    }
+    return depth;
+  }
+
+  uint64_t legacy_spread_by_1_bit(uint32_t v)
+  {
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000ffff0000ffffull;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ffull;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0full;
+    x = (x | (x << 2)) & 0x3333333333333333ull;
+    x = (x | (x << 1)) & 0x5555555555555555ull;
+    return x;
+  }
+
+  uint32_t legacy_compact_by_1_bit(uint64_t x)
+  {
+    x &= 0x5555555555555555ull;
+    x = (x | (x >> 1)) & 0x3333333333333333ull;
+    x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0full;
+    x = (x | (x >> 4)) & 0x00ff00ff00ff00ffull;
+    x = (x | (x >> 8)) & 0x0000ffff0000ffffull;
+    x = (x | (x >> 16)) & 0x00000000ffffffffull;
+    return static_cast<uint32_t>(x);
+  }
+
+  // Runs fn over every value and returns the nanoseconds per call. The
+  // results are summed so the calls cannot be optimized away.
+  template <typename Fn_t>
+  double time_per_call(const std::vector<uint64_t>& values, Fn_t fn,
+    uint64_t& out_checksum)
+  {
+    uint64_t checksum = 0ull;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t value : values) {
+      checksum += fn(value);
+    }
+    std::chrono::duration<double, std::nano> nanos =
+      std::chrono::steady_clock::now() - start;
+    out_checksum = checksum;
+    return nanos.count() / static_cast<double>(values.size());
+  }
+
+  template <typename Fn_t>
+  bool report(const std::string& name, const std::vector<uint64_t>& values,
+    Fn_t fn, uint64_t expected_checksum)
+  {
+    uint64_t checksum = 0ull;
+    double nanos = time_per_call(values, fn, checksum);
+    const bool agrees = checksum == expected_checksum;
+    std::cout << std::setw(24) << name << " " << std::setw(8)
+      << std::fixed << std::setprecision(3) << nanos << " ns/call"
+      << (agrees ? "" : " MISMATCH") << std::endl;
+    return agrees;
+  }
+}
+
+bool run_bit_kernels_bench(std::size_t count)
+{
+  std::vector<uint64_t> values(count);
+  for (uint64_t& value : values) {
+    value = (static_cast<uint64_t>(std::rand()) << 48) ^
+      (static_cast<uint64_t>(std::rand()) << 24) ^ std::rand();
+    // Vary the magnitude so the msb is not always in the top bits.
+    value >>= std::rand() % 64;
+  }
+
+  const MsbKernel original_msb = msb_kernel();
+  const MortonKernel original_morton = morton_kernel();
+  bool good = true;
+
+  uint64_t expected = 0ull;
+  std::cout << "msb_index64" << std::endl;
+  time_per_call(values, [](uint64_t x) { return legacy_msb64(x); },
+    expected);
+  good &= report("legacy binary search", values,
+    [](uint64_t x) { return legacy_msb64(x); }, expected);
+  for (MsbKernel kernel : { MsbKernel::Portable, MsbKernel::Bsr,
+    MsbKernel::Lzcnt }) {
+    if (set_msb_kernel(kernel) != kernel) {
+      continue;
+    }
+    const char* names[] = { "portable", "bsr", "lzcnt" };
+    good &= report(names[static_cast<int32_t>(kernel)], values,
+      [](uint64_t x) { return msb_index64(x); }, expected);
+  }
+
+  std::cout << "spread_bits32" << std::endl;
+  auto legacy_spread = [](uint64_t x)
+  {
+    return legacy_spread_by_1_bit(static_cast<uint32_t>(x));
+  };
+  time_per_call(values, legacy_spread, expected);
+  good &= report("legacy shift ladder", values, legacy_spread, expected);
+  for (MortonKernel kernel : { MortonKernel::Portable, MortonKernel::Bmi2 }) {
+    if (set_morton_kernel(kernel) != kernel) {
+      continue;
+    }
+    const char* names[] = { "portable", "pdep" };
+    good &= report(names[static_cast<int32_t>(kernel)], values,
+      [](uint64_t x) { return spread_bits32(static_cast<uint32_t>(x)); },
+      expected);
+  }
+
+  std::cout << "compact_bits64" << std::endl;
+  time_per_call(values,
+    [](uint64_t x) { return legacy_compact_by_1_bit(x); }, expected);
+  good &= report("legacy shift ladder", values,
+    [](uint64_t x) { return legacy_compact_by_1_bit(x); }, expected);
+  for (MortonKernel kernel : { MortonKernel::Portable, MortonKernel::Bmi2 }) {
+    if (set_morton_kernel(kernel) != kernel) {
+      continue;
+    }
+    const char* names[] = { "portable", "pext" };
+    good &= report(names[static_cast<int32_t>(kernel)], values,
+      [](uint64_t x) { return compact_bits64(x); }, expected);
+  }
+
+  set_msb_kernel(original_msb);
+  set_morton_kernel(original_morton);
+  return good;
+}
@@ -0,0 +1,16 @@
+#ifndef BIT_KERNELS_BENCH_H
+#define BIT_KERNELS_BENCH_H
+
+#include <cstddef>
+
+/// <summary>
+/// Times every <see cref="MsbKernel"/> and <see cref="MortonKernel"/> the
+/// CPU supports, and the shift ladder and binary search implementations
+/// they replaced, over <paramref name="count"/> random values and prints
+/// the nanoseconds per call.
+/// </summary>
+/// <param name="count">The number of values fed to every variant.</param>
+/// <returns>false if any variant disagrees with the others.</returns>
+bool run_bit_kernels_bench(std::size_t count);
+
+#endif
@@ -0,0 +1,145 @@
+#include "prefetch_bench.h"
+
+#include <point_search.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  constexpr int32_t RESULT_COUNT = 20;
+  constexpr std::size_t WARM_QUERIES = 2000ull;
+  constexpr std::size_t COLD_QUERIES = 200ull;
+  // Larger than the last level cache of the machines we run on.
+  constexpr std::size_t EVICTION_BYTES = 64ull << 20;
+
+  float random_unit()
+  {
+    return static_cast<float>(std::rand()) / RAND_MAX * 2.0f - 1.0f;
+  }
+
+  std::vector<Rect> random_queries(std::size_t count)
+  {
+    const float half_sizes[] = { 0.001f, 0.01f, 0.05f, 0.2f };
+    std::vector<Rect> queries(count);
+    for (std::size_t i = 0; i < count; ++i) {
+      const float x = random_unit();
+      const float y = random_unit();
+      const float half = half_sizes[i % 4];
+      queries[i] = { x - half, y - half, x + half, y + half };
+    }
+    return queries;
+  }
+
+  // Writes to every cache line of the eviction buffer, pushing the tree
+  // out of every cache level.
+  void flush_caches(std::vector<char>& eviction)
+  {
+    for (std::size_t i = 0; i < eviction.size(); i += 64) {
+      ++eviction[i];
+    }
+  }
+
+  // Runs every query, timing only the queries, and sums the ranks found so
+  // runs can be compared.
+  double time_queries(quad_tree& tree, const std::vector<Rect>& queries,
+    std::vector<char>* eviction, int64_t& out_checksum)
+  {
+    std::vector<Point> out_points(RESULT_COUNT);
+    std::chrono::duration<double, std::nano> nanos(0.0);
+    int64_t checksum = 0;
+    for (const Rect& rect : queries) {
+      if (eviction != nullptr) {
+        flush_caches(*eviction);
+      }
+      int32_t end_i = 0;
+      auto start = std::chrono::steady_clock::now();
+      tree.query(rect, RESULT_COUNT, end_i, out_points.data());
+      nanos += std::chrono::steady_clock::now() - start;
+      for (int32_t i = 0; i < end_i; ++i) {
+        checksum += out_points[i].rank;
+      }
+    }
+    out_checksum = checksum;
+    return nanos.count() / static_cast<double>(queries.size());
+  }
+}
+
+bool run_prefetch_bench(std::size_t count)
+{
+  std::vector<Point> points(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    points[i] = { static_cast<int8_t>(i), static_cast<int32_t>(i),
+      random_unit(), random_unit() };
+  }
+  // Ranks unrelated to position.
+  for (std::size_t i = count; i > 1; --i) {
+    std::swap(points[i - 1].rank, points[std::rand() % i].rank);
+  }
+
+  const std::vector<Rect> warm_queries = random_queries(WARM_QUERIES);
+  const std::vector<Rect> cold_queries = random_queries(COLD_QUERIES);
+  std::vector<char> eviction(EVICTION_BYTES, 0);
+
+  struct variant
+  {
+    const char* name;
+    bool compact;
+    quad_tree::QueryMode mode;
+  };
+  const variant variants[] = {
+    { "breadth first", false, quad_tree::QueryMode::BreadthFirst },
+    { "best first", false, quad_tree::QueryMode::BestFirst },
+    { "rank merge", false, quad_tree::QueryMode::RankMerge },
+    { "compact", true, quad_tree::QueryMode::BestFirst }
+  };
+
+  bool good = true;
+  for (const variant& v : variants) {
+    quad_tree::BuildOptions options;
+    options.compact_nodes = v.compact;
+    quad_tree tree(points.data(), points.data() + points.size(),
+      quad_tree::MIN_BLOCK_SIZE, (std::max)(count / 512,
+        quad_tree::MIN_BLOCK_SIZE), options);
+    tree.set_query_mode(v.mode);
+
+    std::cout << v.name << std::endl;
+    std::cout << std::setw(10) << "distance" << std::setw(16) << "warm ns"
+      << std::setw(16) << "cold ns" << std::endl;
+    int64_t expected_warm = 0;
+    int64_t expected_cold = 0;
+    // Only breadth first looks a distance ahead, the rest switch on or off.
+    const bool uses_distance = !v.compact &&
+      v.mode == quad_tree::QueryMode::BreadthFirst;
+    const std::vector<std::size_t> distances = uses_distance ?
+      std::vector<std::size_t>{ 0ull, 1ull, 2ull, 4ull, 8ull, 16ull } :
+      std::vector<std::size_t>{ 0ull, 1ull };
+    for (std::size_t distance : distances) {
+      tree.set_prefetch_distance(distance);
+      int64_t warm_checksum = 0;
+      int64_t cold_checksum = 0;
+      time_queries(tree, warm_queries, nullptr, warm_checksum);
+      const double warm = time_queries(tree, warm_queries, nullptr,
+        warm_checksum);
+      const double cold = time_queries(tree, cold_queries, &eviction,
+        cold_checksum);
+      if (distance == 0) {
+        expected_warm = warm_checksum;
+        expected_cold = cold_checksum;
+      }
+      const bool agrees = warm_checksum == expected_warm &&
+        cold_checksum == expected_cold;
+      good &= agrees;
+      std::cout << std::setw(10) << distance << std::setw(16)
+        << std::fixed << std::setprecision(1) << warm << std::setw(16)
+        << cold << (agrees ? "" : " MISMATCH") << std::endl;
+    }
+  }
+  return good;
+}
@@ -0,0 +1,18 @@
+#ifndef PREFETCH_BENCH_H
+#define PREFETCH_BENCH_H
+
+#include <cstddef>
+
+/// <summary>
+/// Builds quad_trees over <paramref name="count"/> random points and times
+/// the same queries at several <see cref="quad_tree::set_prefetch_distance"/>
+/// settings, once with the caches warm from the previous queries and once
+/// with them flushed before every query, and prints the nanoseconds per
+/// query. Modes other than breadth first are only run with prefetching off
+/// and on.
+/// </summary>
+/// <param name="count">The number of points indexed.</param>
+/// <returns>false if any distance returns different results.</returns>
+bool run_prefetch_bench(std::size_t count);
+
+#endif
@@ -1,13 +1,68 @@
 #include "pch.h"
 #include "CppUnitTest.h"
 
+#include "../FastRankedPointsInPolygon/bit_kernels.h"
 #include "../FastRankedPointsInPolygon/point_search.h"
+#include "../FastRankedPointsInPolygon/radix_sort.h"
+#include "../FastRankedPointsInPolygon/rect_filter.h"
+#include "../FastRankedPointsInPolygon/top_k_buffer.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <crtdbg.h>
 #include <ctime>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
+#ifdef _DEBUG
+namespace
+{
+  // Heap allocations seen by the debug heap on counted_thread, and the
+  // most bytes they held at once. The hook sees every module of the process
+  // sharing the debug CRT, the library DLL included. Release builds have no
+  // allocation hooks, the tests using it only run in debug builds.
+  std::thread::id counted_thread;
+  int32_t allocations = 0;
+  std::ptrdiff_t allocated_bytes = 0;
+  std::ptrdiff_t peak_allocated_bytes = 0;
+
+  int count_allocations(int type, void* data, std::size_t size,
+    int block_use, long, const unsigned char*, int)
+  {
+    // The CRT's own blocks are reported too, and must not be inspected.
+    if (block_use == _CRT_BLOCK ||
+      std::this_thread::get_id() != counted_thread) {
+      return TRUE;
+    }
+    if (type == _HOOK_ALLOC || type == _HOOK_REALLOC) {
+      ++allocations;
+      allocated_bytes += size;
+    }
+    if (type == _HOOK_REALLOC || type == _HOOK_FREE) {
+      allocated_bytes -= _msize_dbg(data, block_use);
+    }
+    peak_allocated_bytes = (std::max)(peak_allocated_bytes, allocated_bytes);
+    return TRUE;
+  }
+
+  // Starts counting the allocations of the calling thread from zero.
+  _CRT_ALLOC_HOOK start_counting()
+  {
+    counted_thread = std::this_thread::get_id();
+    allocations = 0;
+    allocated_bytes = 0;
+    peak_allocated_bytes = 0;
+    return _CrtSetAllocHook(count_allocations);
+  }
+}
+#endif
+
 namespace TestFastRankedPointInPolygon
 {
 	TEST_CLASS(TestFastRankedPointInPolygon)
@@ -126,6 +181,125 @@ namespace TestFastRankedPointInPolygon
     {
     }
 
+    std::vector<Point> acquire_uniquely_ranked_points(std::size_t point_count,
+      float lower_bound, float upper_bound)
+    {
+      std::vector<Point> points(point_count);
+      for (std::size_t i = 0; i < point_count; ++i) {
+        points[i] = Point {
+          static_cast<int8_t>(std::rand()),
+          static_cast<int32_t>(i),
+          frand(lower_bound, upper_bound),
+          frand(lower_bound, upper_bound)
+        };
+      }
+      for (std::size_t i = point_count; i > 1; --i) {
+        std::swap(points[i - 1].rank, points[std::rand() % i].rank);
+      }
+      return points;
+    }
+
+    // The points most query tests search: 16 full blocks on [-16, +16].
+    std::vector<Point> acquire_test_points()
+    {
+      return acquire_uniquely_ranked_points(16 * quad_tree::MAX_BLOCK_SIZE,
+        -16.0f, +16.0f);
+    }
+
+    // A band, a small box and the whole of acquire_test_points.
+    std::vector<Rect> test_rects()
+    {
+      return {
+        { -8.0f, -4.0f, +2.0f, +12.0f }, { -0.5f, -0.5f, +0.5f, +0.5f },
+        { -16.0f, -16.0f, +16.0f, +16.0f }
+      };
+    }
+
+    std::vector<Point> brute_force_query(const std::vector<Point>& points,
+      const Rect& rect, int32_t count)
+    {
+      std::vector<Point> ret;
+      std::copy_if(points.begin(), points.end(), std::back_inserter(ret),
+        [&](const Point& p)
+        {
+          return intersect_point(p, rect);
+        });
+      std::sort(ret.begin(), ret.end());
+      ret.resize((std::min)(ret.size(), static_cast<std::size_t>(count)));
+      return ret;
+    }
+
+    template <typename Tree_t>
+    void assert_rect_matches_brute_force(Tree_t& tree,
+      const std::vector<Point>& points, const Rect& rect, int32_t count)
+    {
+      std::vector<Point> expected = brute_force_query(points, rect, count);
+      std::vector<Point> actual(count);
+      int32_t end_i = 0;
+      tree.query(rect, count, end_i, actual.data());
+      Assert::AreEqual(expected.size(), static_cast<std::size_t>(end_i));
+      Assert::IsTrue(std::equal(expected.begin(), expected.end(),
+        actual.begin()));
+    }
+
+    template <typename Tree_t>
+    void assert_query_matches_brute_force(Tree_t& tree,
+      const std::vector<Point>& points, float lower_bound, float upper_bound)
+    {
+      for (std::size_t q = 0; q < 64; ++q) {
+        float x1 = frand(lower_bound, upper_bound);
+        float x2 = frand(lower_bound, upper_bound);
+        float y1 = frand(lower_bound, upper_bound);
+        float y2 = frand(lower_bound, upper_bound);
+        Rect rect = { (std::min)(x1, x2), (std::min)(y1, y2),
+          (std::max)(x1, x2), (std::max)(y1, y2) };
+        assert_rect_matches_brute_force(tree, points, rect,
+          (q % 2 == 0) ? 10 : 50);
+      }
+    }
+
+    template <typename Tree_t>
+    void assert_rects_match_brute_force(Tree_t& tree,
+      const std::vector<Point>& points, const std::vector<Rect>& rects,
+      const std::vector<int32_t>& counts)
+    {
+      for (int32_t count : counts) {
+        for (const Rect& rect : rects) {
+          assert_rect_matches_brute_force(tree, points, rect, count);
+        }
+      }
+    }
+
+    template <typename Count_t>
+    void assert_top_k_buffer_matches_sort(const Count_t capacity,
+      const std::vector<Point>& offered)
+    {
+      top_k_buffer<Count_t> results(capacity, nullptr, 0);
+      std::vector<Point> expected;
+      for (const Point& point : offered) {
+        const bool fits = expected.size() <
+          static_cast<std::size_t>(static_cast<int32_t>(capacity)) ||
+          point.rank <= expected.back().rank;
+        Assert::AreEqual(fits, results.offer(point));
+        if (fits) {
+          // Ahead of equal ranks, as std::lower_bound places it.
+          expected.insert(std::lower_bound(expected.begin(), expected.end(),
+            point, [](const Point& lhs, const Point& rhs)
+            {
+              return lhs.rank < rhs.rank;
+            }), point);
+          expected.resize((std::min)(expected.size(),
+            static_cast<std::size_t>(static_cast<int32_t>(capacity))));
+        }
+      }
+      Assert::AreEqual(static_cast<int32_t>(expected.size()),
+        results.size());
+      std::vector<Point> actual(static_cast<int32_t>(capacity));
+      Assert::AreEqual(results.size(), results.copy_to(actual.data()));
+      Assert::IsTrue(std::equal(expected.begin(), expected.end(),
+        actual.begin()));
+    }
+
   public:
     TEST_METHOD(TestTestData)
     {
@@ -159,6 +333,932 @@ namespace TestFastRankedPointInPolygon
       release_resources(points);
     }
 
+    TEST_METHOD(TestQueryModesMatchBruteForce)
+    {
+      auto points = acquire_test_points();
+      quad_tree tree(points.data(), points.data() + points.size());
+      Assert::IsTrue(quad_tree::QueryMode::BestFirst == tree.query_mode());
+      assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+      tree.set_query_mode(quad_tree::QueryMode::BreadthFirst);
+      assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+    }
+
+    TEST_METHOD(TestTopKSamplesAnswerCoveredQueries)
+    {
+      auto points = acquire_test_points();
+      const Rect everything = { -16.0f, -16.0f, +16.0f, +16.0f };
+      for (std::size_t top_k_size : { 0ull, 1ull, 32ull }) {
+        quad_tree::BuildOptions options;
+        options.top_k_size = top_k_size;
+        quad_tree tree(points.data(), points.data() + points.size(),
+          quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE, options);
+        assert_rects_match_brute_force(tree, points, { everything },
+          { 1, 10, 32, 33, 100 });
+        assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+      }
+    }
+
+    TEST_METHOD(TestContainedAndStraddlingLeaves)
+    {
+      auto points = acquire_uniquely_ranked_points(500, -16.0f, +16.0f);
+      quad_tree tree(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, points.size());
+      const std::vector<Rect> rects = {
+        { -16.0f, -16.0f, +16.0f, +16.0f },
+        { -32.0f, -32.0f, +32.0f, +32.0f },
+        { -16.0f, -16.0f, +0.0f, +16.0f },
+        { +17.0f, +17.0f, +32.0f, +32.0f }
+      };
+      assert_rects_match_brute_force(tree, points, rects, { 20 });
+    }
+
+    TEST_METHOD(TestLinearQuadTreeMatchesBruteForce)
+    {
+      auto points = acquire_test_points();
+      linear_quad_tree tree(points.data(), points.data() + points.size(),
+        quad_tree::MAX_BLOCK_SIZE / 10);
+      Assert::AreEqual(points.size(), tree.size());
+      Assert::IsTrue(tree.node_count() > 1);
+      assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+    }
+
+    TEST_METHOD(TestPriorityKdTreeMatchesBruteForce)
+    {
+      auto points = acquire_test_points();
+      // Points sharing a location only differ by rank.
+      for (std::size_t i = 0; i < 100; ++i) {
+        points[i].x = points[100].x;
+        points[i].y = points[100].y;
+      }
+      priority_kd_tree tree(points.data(), points.data() + points.size());
+      Assert::AreEqual(points.size(), tree.size());
+      assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+
+      const Rect rect = { points[100].x, points[100].y, points[100].x,
+        points[100].y };
+      assert_rect_matches_brute_force(tree, points, rect, 50);
+    }
+
+    TEST_METHOD(TestRankScanMatchesBruteForce)
+    {
+      const SimdLevel original = rect_filter_level();
+      auto points = acquire_uniquely_ranked_points(
+        16 * quad_tree::MAX_BLOCK_SIZE + 7, -16.0f, +16.0f);
+      rank_scan scan(points.data(), points.data() + points.size());
+      Assert::AreEqual(points.size(), scan.size());
+      for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::Avx2,
+        SimdLevel::Avx512 }) {
+        set_rect_filter_level(level);
+        assert_query_matches_brute_force(scan, points, -16.0f, +16.0f);
+      }
+      set_rect_filter_level(original);
+    }
+
+    TEST_METHOD(TestQueryPlannerPicksByCoverage)
+    {
+      auto points = acquire_uniquely_ranked_points(
+        64 * quad_tree::MAX_BLOCK_SIZE, -16.0f, +16.0f);
+      query_planner planner(points.data(), points.data() + points.size(),
+        points.size() / 512);
+
+      const Rect half = { -16.0f, -16.0f, +0.0f, +16.0f };
+      const double expected = static_cast<double>(
+        brute_force_query(points, half, static_cast<int32_t>(
+          points.size())).size());
+      Assert::IsTrue(std::abs(planner.estimate(half) - expected) <
+        0.02 * expected);
+
+      const Rect everything = { -16.0f, -16.0f, +16.0f, +16.0f };
+      Assert::IsTrue(QueryStrategy::RankScan ==
+        planner.plan(everything, 10).strategy);
+      const Rect tiny = { +1.0f, +1.0f, +1.05f, +1.05f };
+      Assert::IsTrue(QueryStrategy::TreeTraversal ==
+        planner.plan(tiny, 10).strategy);
+
+      SearchOptions options;
+      options.engine = SearchEngine::Planned;
+      SearchContext* sc = create_with_options(points.data(),
+        points.data() + points.size(), &options);
+      QueryPlan plan = {};
+      std::vector<Point> actual(10);
+      search(sc, everything, 10, actual.data());
+      Assert::IsTrue(last_query_plan(sc, &plan));
+      Assert::IsTrue(QueryStrategy::RankScan == plan.strategy);
+      search(sc, tiny, 10, actual.data());
+      Assert::IsTrue(last_query_plan(sc, &plan));
+      Assert::IsTrue(QueryStrategy::TreeTraversal == plan.strategy);
+
+      // Every thread sees the plan of its own last search.
+      QueryPlan other_plan = {};
+      std::thread other([&]()
+      {
+        std::vector<Point> other_actual(10);
+        search(sc, everything, 10, other_actual.data());
+        last_query_plan(sc, &other_plan);
+      });
+      other.join();
+      Assert::IsTrue(QueryStrategy::RankScan == other_plan.strategy);
+      Assert::IsTrue(last_query_plan(sc, &plan));
+      Assert::IsTrue(QueryStrategy::TreeTraversal == plan.strategy);
+      Assert::IsTrue(explain_query(sc, everything, 10, &plan));
+      Assert::IsTrue(QueryStrategy::RankScan == plan.strategy);
+      destroy(sc);
+
+      sc = create(points.data(), points.data() + points.size());
+      Assert::IsFalse(explain_query(sc, everything, 10, &plan));
+      Assert::IsFalse(last_query_plan(sc, &plan));
+      destroy(sc);
+    }
+
+    TEST_METHOD(TestQueryPlannerIgnoresOutliers)
+    {
+      auto points = acquire_uniquely_ranked_points(100000, 0.0f, 1.0f);
+      points.push_back({ 0, 100000, +1.0e30f, 0.5f });
+      points.push_back({ 0, 100001, std::nanf(""), 0.5f });
+      query_planner planner(points.data(), points.data() + points.size(),
+        points.size() / 512);
+
+      // The outliers leave the rest of the points spread over the grid.
+      const Rect everything = { 0.0f, 0.0f, 1.0f, 1.0f };
+      Assert::IsTrue(std::abs(planner.estimate(everything) - 100000.0) <
+        0.02 * 100000.0);
+      const Rect half = { 0.0f, 0.0f, 0.5f, 1.0f };
+      Assert::IsTrue(std::abs(planner.estimate(half) - 50000.0) <
+        0.05 * 50000.0);
+      Assert::IsTrue(QueryStrategy::RankScan ==
+        planner.plan(everything, 10).strategy);
+      const Rect tiny = { 0.5f, 0.5f, 0.502f, 0.502f };
+      Assert::IsTrue(QueryStrategy::TreeTraversal ==
+        planner.plan(tiny, 10).strategy);
+
+      const Rect nan_rect = { std::nanf(""), 0.0f, 1.0f, 1.0f };
+      Assert::AreEqual(0.0, planner.estimate(nan_rect));
+    }
+
+    TEST_METHOD(TestSearchContextEngines)
+    {
+      auto points = acquire_uniquely_ranked_points(20000, -16.0f, +16.0f);
+      const Rect rect = { -8.0f, -4.0f, +2.0f, +12.0f };
+      std::vector<Point> expected = brute_force_query(points, rect, 20);
+      for (SearchEngine engine :
+        { SearchEngine::QuadTree, SearchEngine::LinearQuadTree,
+          SearchEngine::PriorityKdTree, SearchEngine::RankScan,
+          SearchEngine::Planned }) {
+        SearchOptions options;
+        options.engine = engine;
+        SearchContext* sc = create_with_options(points.data(),
+          points.data() + points.size(), &options);
+        std::vector<Point> actual(20);
+        int32_t copied = search(sc, rect, 20, actual.data());
+        Assert::AreEqual(expected.size(), static_cast<std::size_t>(copied));
+        Assert::IsTrue(std::equal(expected.begin(), expected.end(),
+          actual.begin()));
+        Assert::IsTrue(destroy(sc) == nullptr);
+      }
+    }
+
+    TEST_METHOD(TestCompactNodesMatchBruteForce)
+    {
+      auto points = acquire_test_points();
+      quad_tree::BuildOptions options;
+      options.compact_nodes = true;
+      quad_tree tree(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 10, options);
+      Assert::IsTrue(tree.is_compact());
+      Assert::AreEqual(points.size(), tree.size());
+      assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+    }
+
+    TEST_METHOD(TestRectFilterKernelsAgree)
+    {
+      const SimdLevel original = rect_filter_level();
+      auto points = acquire_uniquely_ranked_points(
+        RECT_FILTER_BLOCK_SIZE - 3, -1.0f, +1.0f);
+      soa_points soa;
+      std::size_t offset = soa.append(points.data(), points.size());
+      soa.finish();
+      Assert::AreEqual(std::size_t(0), offset);
+
+      const Rect rect = { -0.5f, -0.25f, +0.75f, +0.5f };
+      uint64_t expected = 0ull;
+      for (std::size_t i = 0; i < points.size(); ++i) {
+        if (points[i].x >= rect.lx && points[i].x <= rect.hx &&
+          points[i].y >= rect.ly && points[i].y <= rect.hy) {
+          expected |= 1ull << i;
+        }
+      }
+
+      for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::Avx2,
+        SimdLevel::Avx512 }) {
+        set_rect_filter_level(level);
+        // The NaN padding after the last point never passes.
+        Assert::AreEqual(expected, filter_rect_block(soa.x(), soa.y(), rect));
+      }
+      set_rect_filter_level(original);
+    }
+
+    TEST_METHOD(TestSoaLeavesMatchBruteForce)
+    {
+      const SimdLevel original = rect_filter_level();
+      auto points = acquire_test_points();
+      quad_tree::BuildOptions options;
+      options.leaf_layout = quad_tree::LeafLayout::Soa;
+      quad_tree tree(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 4, options);
+      Assert::IsTrue(tree.is_compact());
+      Assert::AreEqual(points.size(), tree.size());
+
+      for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::Avx2,
+        SimdLevel::Avx512 }) {
+        set_rect_filter_level(level);
+        assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+      }
+      set_rect_filter_level(original);
+    }
+
+    TEST_METHOD(TestQuantizedLeavesMatchBruteForce)
+    {
+      const SimdLevel original = rect_filter_level();
+      auto points = acquire_test_points();
+      quad_tree::BuildOptions options;
+      options.leaf_layout = quad_tree::LeafLayout::Quantized;
+      quad_tree tree(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 4, options);
+      Assert::IsTrue(tree.is_compact());
+      Assert::AreEqual(points.size(), tree.size());
+
+      for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::Avx2,
+        SimdLevel::Avx512 }) {
+        set_rect_filter_level(level);
+        assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+
+        // Rects whose edges pass exactly through points only get their
+        // edges right through the exact float checks.
+        for (std::size_t q = 0; q < 32; ++q) {
+          const Point& a = points[std::rand() % points.size()];
+          const Point& b = points[std::rand() % points.size()];
+          Rect rect = { (std::min)(a.x, b.x), (std::min)(a.y, b.y),
+            (std::max)(a.x, b.x), (std::max)(a.y, b.y) };
+          assert_rect_matches_brute_force(tree, points, rect, 50);
+        }
+      }
+      set_rect_filter_level(original);
+    }
+
+    TEST_METHOD(TestTaskPoolRunsNestedGroups)
+    {
+      task_pool pool(4);
+      Assert::AreEqual(std::size_t(4), pool.thread_count());
+      std::vector<int64_t> sums(64, 0);
+      task_pool::task_group outer;
+      for (std::size_t i = 0; i < sums.size(); ++i) {
+        pool.run(outer, [&pool, &sums, i]()
+        {
+          std::vector<int64_t> parts(16, 0);
+          task_pool::task_group inner;
+          for (std::size_t j = 0; j < parts.size(); ++j) {
+            pool.run(inner, [&parts, i, j]()
+            {
+              parts[j] = static_cast<int64_t>(i * j);
+            });
+          }
+          pool.wait(inner);
+          for (int64_t part : parts) {
+            sums[i] += part;
+          }
+        });
+      }
+      pool.wait(outer);
+      for (std::size_t i = 0; i < sums.size(); ++i) {
+        Assert::AreEqual(static_cast<int64_t>(i * 120), sums[i]);
+      }
+
+      task_pool::task_group failing;
+      pool.run(failing, []()
+      {
+        throw std::runtime_error("task failed");
+      });
+      bool thrown = false;
+      try {
+        pool.wait(failing);
+      } catch (const std::runtime_error&) {
+        thrown = true;
+      }
+      Assert::IsTrue(thrown);
+    }
+
+    TEST_METHOD(TestParallelBuildMatchesSerialBuild)
+    {
+      auto points = acquire_uniquely_ranked_points(
+        64 * quad_tree::MAX_BLOCK_SIZE, -16.0f, +16.0f);
+      quad_tree serial(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 10);
+      quad_tree::BuildOptions options;
+      options.build_threads = 4;
+      options.parallel_cutoff = quad_tree::MAX_BLOCK_SIZE;
+      quad_tree parallel(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 10, options);
+
+      Assert::AreEqual(serial.size(), parallel.size());
+      Assert::AreEqual(serial.node_count(), parallel.node_count());
+      for (std::size_t q = 0; q < 64; ++q) {
+        float x1 = frand(-16.0f, +16.0f);
+        float x2 = frand(-16.0f, +16.0f);
+        float y1 = frand(-16.0f, +16.0f);
+        float y2 = frand(-16.0f, +16.0f);
+        Rect rect = { (std::min)(x1, x2), (std::min)(y1, y2),
+          (std::max)(x1, x2), (std::max)(y1, y2) };
+        std::vector<Point> expected(20);
+        std::vector<Point> actual(20);
+        int32_t expected_end_i = 0;
+        int32_t actual_end_i = 0;
+        serial.query(rect, 20, expected_end_i, expected.data());
+        parallel.query(rect, 20, actual_end_i, actual.data());
+        Assert::AreEqual(expected_end_i, actual_end_i);
+        Assert::IsTrue(std::equal(expected.begin(),
+          expected.begin() + expected_end_i, actual.begin()));
+      }
+      assert_query_matches_brute_force(parallel, points, -16.0f, +16.0f);
+    }
+
+    TEST_METHOD(TestRadixSortIsStable)
+    {
+      std::vector<uint64_t> keys(RADIX_SORT_PARALLEL_CUTOFF * 2);
+      std::vector<uint32_t> values(keys.size());
+      for (std::size_t i = 0; i < keys.size(); ++i) {
+        // Few distinct keys sharing a depth bit, like quad_keys do.
+        keys[i] = quad_tree::min_id(quad_tree::max_depth()) |
+          (static_cast<uint64_t>(std::rand() % 1024) << 20);
+        values[i] = static_cast<uint32_t>(i);
+      }
+      std::vector<std::pair<uint64_t, uint32_t>> expected(keys.size());
+      for (std::size_t i = 0; i < keys.size(); ++i) {
+        expected[i] = std::make_pair(keys[i], values[i]);
+      }
+      std::sort(expected.begin(), expected.end());
+
+      task_pool pool(3);
+      for (task_pool* used : { static_cast<task_pool*>(nullptr), &pool }) {
+        std::vector<uint64_t> sorted_keys = keys;
+        std::vector<uint32_t> sorted_values = values;
+        radix_sort(sorted_keys, sorted_values, used);
+        for (std::size_t i = 0; i < expected.size(); ++i) {
+          Assert::AreEqual(expected[i].first, sorted_keys[i]);
+          Assert::AreEqual(expected[i].second, sorted_values[i]);
+        }
+      }
+    }
+
+    TEST_METHOD(TestBulkLoadMatchesRecursiveBuild)
+    {
+      auto points = acquire_uniquely_ranked_points(
+        64 * quad_tree::MAX_BLOCK_SIZE, -16.0f, +16.0f);
+      quad_tree::BuildOptions options;
+      options.compact_nodes = true;
+      quad_tree recursive(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 10, options);
+      options.bulk_load = true;
+      quad_tree bulk(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 10, options);
+      options.build_threads = 4;
+      options.parallel_cutoff = quad_tree::MAX_BLOCK_SIZE;
+      quad_tree parallel_bulk(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 10, options);
+
+      Assert::AreEqual(recursive.node_count(), bulk.node_count());
+      Assert::AreEqual(recursive.node_count(), parallel_bulk.node_count());
+      Assert::AreEqual(points.size(), bulk.size());
+      assert_query_matches_brute_force(bulk, points, -16.0f, +16.0f);
+      assert_query_matches_brute_force(parallel_bulk, points,
+        -16.0f, +16.0f);
+    }
+
+    TEST_METHOD(TestInPlaceBuildLeavesCallerPointersAndReportsMemory)
+    {
+      auto points = acquire_test_points();
+      std::vector<Point*> pointers;
+      for (auto& p : points) {
+        pointers.push_back(&p);
+      }
+      const std::vector<Point*> before = pointers;
+      quad_tree tree(pointers.begin(), pointers.end(),
+        quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 10);
+      Assert::IsTrue(before == pointers);
+      Assert::AreEqual(points.size(), tree.size());
+
+      const quad_tree::BuildStats& stats = tree.build_stats();
+      Assert::IsTrue(stats.index_bytes >= points.size() * sizeof(Point));
+      Assert::IsTrue(stats.peak_bytes > stats.index_bytes);
+      assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+
+#ifdef _DEBUG
+      // The reported peak is checked against the bytes the build really
+      // held at once.
+      std::vector<quad_tree::BuildOptions> configurations(4);
+      configurations[1].bulk_load = true;
+      configurations[2].compact_nodes = true;
+      configurations[2].bulk_load = true;
+      configurations[3].leaf_layout = quad_tree::LeafLayout::Soa;
+      for (const quad_tree::BuildOptions& options : configurations) {
+        _CRT_ALLOC_HOOK previous = start_counting();
+        quad_tree measured(pointers.begin(), pointers.end(),
+          quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 10,
+          options);
+        _CrtSetAllocHook(previous);
+        const double reported = static_cast<double>(
+          measured.build_stats().peak_bytes);
+        const double held = static_cast<double>(peak_allocated_bytes);
+        Assert::IsTrue(std::abs(held - reported) <= 0.02 * reported);
+      }
+#endif
+    }
+
+    TEST_METHOD(TestBatchedQuadKeysMatchScalar)
+    {
+      auto points = acquire_uniquely_ranked_points(1027, -16.0f, +16.0f);
+      points[0].x = -16.0f;
+      points[0].y = -16.0f;
+      points[1].x = +16.0f;
+      points[1].y = +16.0f;
+      points[2].x = +16.0f;
+      points[2].y = -16.0f;
+      DoubleRect bounds;
+      quad_tree::compute_bounds(points.data(), points.data() + points.size(),
+        bounds);
+      std::vector<const Point*> pointers;
+      for (const auto& p : points) {
+        pointers.push_back(&p);
+      }
+
+      std::vector<uint64_t> keys(points.size());
+      std::vector<uint64_t> pointer_keys(points.size());
+      for (uint8_t depth : { 0, 1, 2, 15, 28, 29 }) {
+        quad_tree::compute_quad_keys(points.data(), points.size(), depth,
+          bounds, keys.data());
+        quad_tree::compute_quad_keys(pointers.data(), pointers.size(), depth,
+          bounds, pointer_keys.data());
+        for (std::size_t i = 0; i < points.size(); ++i) {
+          const uint64_t expected = quad_tree::compute_quad_key(points[i],
+            depth, bounds);
+          Assert::AreEqual(expected, keys[i]);
+          Assert::AreEqual(expected, pointer_keys[i]);
+        }
+      }
+    }
+
+    TEST_METHOD(TestBitKernelsAgree)
+    {
+      const MsbKernel original_msb = msb_kernel();
+      const MortonKernel original_morton = morton_kernel();
+      std::vector<uint64_t> values = { 0ull, 1ull, 2ull, 3ull,
+        0x8000000000000000ull, 0xFFFFFFFFFFFFFFFFull, 0x5555555555555555ull,
+        0xAAAAAAAAAAAAAAAAull };
+      for (int i = 0; i < 1000; ++i) {
+        values.push_back((static_cast<uint64_t>(rand()) << 48) ^
+          (static_cast<uint64_t>(rand()) << 24) ^ rand());
+      }
+
+      for (MsbKernel kernel : { MsbKernel::Portable, MsbKernel::Bsr,
+        MsbKernel::Lzcnt }) {
+        set_msb_kernel(kernel);
+        for (uint64_t value : values) {
+          int32_t expected = -1;
+          for (int32_t bit = 0; bit < 64; ++bit) {
+            if ((value >> bit) & 0x1ull) {
+              expected = bit;
+            }
+          }
+          Assert::AreEqual(expected, msb_index64(value));
+        }
+      }
+
+      for (MortonKernel kernel : { MortonKernel::Portable,
+        MortonKernel::Bmi2 }) {
+        set_morton_kernel(kernel);
+        for (uint64_t value : values) {
+          uint64_t spread = 0ull;
+          uint32_t compact = 0u;
+          for (uint32_t bit = 0; bit < 32; ++bit) {
+            spread |= ((value >> bit) & 0x1ull) << (2u * bit);
+            compact |= static_cast<uint32_t>((value >> (2u * bit)) & 0x1ull)
+              << bit;
+          }
+          Assert::AreEqual(spread,
+            spread_bits32(static_cast<uint32_t>(value)));
+          Assert::AreEqual(compact, compact_bits64(value));
+          Assert::AreEqual(static_cast<uint32_t>(value),
+            compact_bits64(spread_bits32(static_cast<uint32_t>(value))));
+        }
+      }
+      set_msb_kernel(original_msb);
+      set_morton_kernel(original_morton);
+    }
+
+    TEST_METHOD(TestSplitPoliciesBoundHeightOnClusteredData)
+    {
+      auto points = acquire_test_points();
+      // Huddle all but the two corner points around three coordinates.
+      const float centers[3][2] = { { -7.0f, 3.0f }, { 5.0f, 5.0f },
+        { 11.0f, -9.0f } };
+      for (std::size_t i = 2; i < points.size(); ++i) {
+        const float* center = centers[i % 3];
+        points[i].x = center[0] + points[i].x * 1.0e-4f;
+        points[i].y = center[1] + points[i].y * 1.0e-4f;
+      }
+      points[0].x = -16.0f;
+      points[0].y = -16.0f;
+      points[1].x = +16.0f;
+      points[1].y = +16.0f;
+
+      const std::size_t leaf_size = quad_tree::MAX_BLOCK_SIZE / 100;
+      quad_tree::BuildOptions options;
+      quad_tree midpoint(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, leaf_size, options);
+      options.split_policy = quad_tree::SplitPolicy::Median;
+      quad_tree median(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, leaf_size, options);
+      options.split_policy = quad_tree::SplitPolicy::SurfaceArea;
+      options.compact_nodes = true;
+      quad_tree surface_area(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, leaf_size, options);
+
+      std::size_t balanced_height = 1;
+      for (std::size_t n = points.size(); n > leaf_size; n = (n + 3) / 4) {
+        ++balanced_height;
+      }
+      Assert::IsTrue(median.height() <= balanced_height);
+      Assert::IsTrue(median.height() < midpoint.height());
+      Assert::IsTrue(surface_area.height() < midpoint.height());
+      Assert::AreEqual(points.size(), median.size());
+      Assert::AreEqual(points.size(), surface_area.size());
+      assert_query_matches_brute_force(median, points, -16.0f, +16.0f);
+      assert_query_matches_brute_force(surface_area, points, -16.0f, +16.0f);
+    }
+
+    TEST_METHOD(TestDuplicatePointsCollapseIntoOneLeaf)
+    {
+      auto points = acquire_test_points();
+      // A quarter of the points sit on the upper right corner, which used
+      // to hit the key at max depth, and a quarter a float ulp apart.
+      const std::size_t quarter = points.size() / 4;
+      for (std::size_t i = 0; i < quarter; ++i) {
+        points[i].x = +16.0f;
+        points[i].y = +16.0f;
+        points[quarter + i].x = (i % 2 == 0) ? 3.0f : std::nextafter(3.0f,
+          4.0f);
+        points[quarter + i].y = -5.0f;
+      }
+      points.back().x = -16.0f;
+      points.back().y = -16.0f;
+
+      const std::size_t leaf_size = quad_tree::MAX_BLOCK_SIZE / 10;
+      quad_tree::BuildOptions options;
+      quad_tree recursive(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, leaf_size, options);
+      options.bulk_load = true;
+      quad_tree bulk(points.data(), points.data() + points.size(),
+        quad_tree::MIN_BLOCK_SIZE, leaf_size, options);
+
+      // Without collapsing both clusters chain down to max_depth().
+      Assert::IsTrue(recursive.height() < quad_tree::max_depth() / 2);
+      Assert::IsTrue(bulk.height() < quad_tree::max_depth() / 2);
+      Assert::AreEqual(recursive.node_count(), bulk.node_count());
+      Assert::AreEqual(points.size(), recursive.size());
+      assert_query_matches_brute_force(recursive, points, -16.0f, +16.0f);
+      assert_query_matches_brute_force(bulk, points, -16.0f, +16.0f);
+
+      const Rect corner = { +15.0f, +15.0f, +16.0f, +16.0f };
+      assert_rect_matches_brute_force(recursive, points, corner, 10);
+    }
+
+    TEST_METHOD(TestOutliersAreSearchableAndKeepBoundsTight)
+    {
+      auto points = acquire_test_points();
+      // A far point past every side spread through the input, and one that
+      // is not a number.
+      points[points.size() / 5].x = -1.0e30f;
+      points[2 * points.size() / 5].x = +1.0e30f;
+      points[3 * points.size() / 5].y = -1.0e30f;
+      points[4 * points.size() / 5].y = +1.0e30f;
+      points[1].x = std::nanf("");
+
+      for (bool compact : { false, true }) {
+        quad_tree::BuildOptions options;
+        options.compact_nodes = compact;
+        quad_tree tree(points.data(), points.data() + points.size(),
+          quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE, options);
+        Assert::AreEqual(std::size_t(5), tree.outlier_count());
+        Assert::AreEqual(points.size(), tree.size());
+        Assert::AreEqual(-16.0, tree.global_bounds().lx);
+        Assert::AreEqual(+16.0, tree.global_bounds().hy);
+
+        assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+        const Rect everything = { -2.0e30f, -2.0e30f, +2.0e30f, +2.0e30f };
+        assert_rects_match_brute_force(tree, points, { everything },
+          { 1, 5, 50 });
+      }
+    }
+
+    TEST_METHOD(TestAutoTunePicksACandidateAndRecordsIt)
+    {
+      auto points = acquire_uniquely_ranked_points(
+        32 * quad_tree::MAX_BLOCK_SIZE, -16.0f, +16.0f);
+      const std::vector<Rect> workload = test_rects();
+      for (bool supplied : { false, true }) {
+        SearchOptions options;
+        options.auto_tune = true;
+        options.tune_workload.sample_size = 4 * quad_tree::MAX_BLOCK_SIZE;
+        if (supplied) {
+          options.tune_workload.queries = workload.data();
+          options.tune_workload.query_count = workload.size();
+        }
+        SearchContext* sc = create_with_options(points.data(),
+          points.data() + points.size(), &options);
+
+        TuneResult tuning = {};
+        Assert::IsTrue(tuned_parameters(sc, &tuning));
+        Assert::IsTrue(std::find(std::begin(TUNE_LEAF_SIZES),
+          std::end(TUNE_LEAF_SIZES), tuning.max_block_size) !=
+          std::end(TUNE_LEAF_SIZES));
+        Assert::AreEqual(options.tune_workload.sample_size,
+          tuning.sample_size);
+        Assert::AreEqual(supplied ? workload.size() :
+          TuneWorkload::GENERATED_QUERIES, tuning.query_count);
+        Assert::AreEqual(tuning.max_block_size, sc->options().max_block_size);
+        Assert::IsTrue(tuning.split_policy == sc->options().split_policy);
+
+        assert_rects_match_brute_force(*sc->tree(), points, workload, { 20 });
+        Assert::IsTrue(destroy(sc) == nullptr);
+      }
+
+      SearchContext* sc = create(points.data(), points.data() + 100);
+      TuneResult tuning = {};
+      Assert::IsFalse(tuned_parameters(sc, &tuning));
+      Assert::AreEqual(std::size_t(quad_tree::MIN_BLOCK_SIZE),
+        sc->options().max_block_size);
+      Assert::IsTrue(destroy(sc) == nullptr);
+    }
+
+    TEST_METHOD(TestTuningReplaysEveryQueryFromEmptyResults)
+    {
+      auto points = acquire_test_points();
+      quad_tree tree(points.data(), points.data() + points.size());
+      // Each rect misses most of the points found by the one before it.
+      const std::vector<Rect> rects = test_rects();
+      const int32_t count = 20;
+      std::vector<Point> out_points(rects.size() * count);
+      std::vector<int32_t> out_counts(rects.size());
+      // A second replay writes over the results of the first.
+      for (int32_t pass = 0; pass < 2; ++pass) {
+        replay_queries(tree, rects.data(), rects.size(), count,
+          out_points.data(), out_counts.data());
+        for (std::size_t i = 0; i < rects.size(); ++i) {
+          std::vector<Point> expected = brute_force_query(points, rects[i],
+            count);
+          Assert::AreEqual(expected.size(),
+            static_cast<std::size_t>(out_counts[i]));
+          Assert::IsTrue(std::equal(expected.begin(), expected.end(),
+            out_points.begin() + i * count));
+        }
+      }
+    }
+
+    TEST_METHOD(TestFixedCountQueriesMatchGenericCounts)
+    {
+      auto points = acquire_test_points();
+      for (quad_tree::LeafLayout layout : { quad_tree::LeafLayout::Packed,
+        quad_tree::LeafLayout::Soa }) {
+        for (bool compact : { false, true }) {
+          quad_tree::BuildOptions options;
+          options.compact_nodes = compact;
+          options.leaf_layout = layout;
+          quad_tree tree(points.data(), points.data() + points.size(),
+            quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 10,
+            options);
+          // The specialized counts and their neighbours on the generic path.
+          assert_rects_match_brute_force(tree, points, test_rects(),
+            { 9, 10, 11, 19, 20, 21, 49, 50, 51 });
+        }
+      }
+    }
+
+    TEST_METHOD(TestTopKBufferKeepsLowestRanks)
+    {
+      std::vector<Point> offered(2000);
+      for (std::size_t i = 0; i < offered.size(); ++i) {
+        // Few distinct ranks so ties are common.
+        offered[i] = { static_cast<int8_t>(i), std::rand() % 200,
+          static_cast<float>(i), 0.0f };
+      }
+      for (int32_t capacity : { 1, 3, 4, 5, 37 }) {
+        assert_top_k_buffer_matches_sort(capacity, offered);
+      }
+      assert_top_k_buffer_matches_sort(FixedCount<10>(), offered);
+      assert_top_k_buffer_matches_sort(FixedCount<50>(), offered);
+
+      // Offered in rank order, the threshold settles after capacity points.
+      std::sort(offered.begin(), offered.end(),
+        [](const Point& lhs, const Point& rhs)
+        {
+          return lhs.rank < rhs.rank;
+        });
+      std::vector<Point> held(offered.begin(), offered.begin() + 19);
+      top_k_buffer<int32_t> results(20, held.data(), 19);
+      Assert::AreEqual((std::numeric_limits<int32_t>::max)(),
+        results.threshold());
+      results.offer(offered[19]);
+      Assert::AreEqual(offered[19].rank, results.threshold());
+      Assert::AreEqual(20, results.size());
+      std::vector<Point> copied(20);
+      Assert::AreEqual(20, results.copy_to(copied.data()));
+      for (int32_t i = 0; i < 20; ++i) {
+        Assert::AreEqual(offered[i].rank, copied[i].rank);
+      }
+
+      // Held points out of rank order, and more of them than fit, are
+      // sorted and trimmed.
+      std::vector<Point> unsorted(offered.begin(), offered.begin() + 30);
+      std::reverse(unsorted.begin(), unsorted.end());
+      top_k_buffer<FixedCount<10>> trimmed(FixedCount<10>(),
+        unsorted.data(), 30);
+      Assert::AreEqual(10, trimmed.size());
+      Assert::AreEqual(offered[9].rank, trimmed.threshold());
+      Assert::AreEqual(10, trimmed.copy_to(copied.data()));
+      for (int32_t i = 0; i < 10; ++i) {
+        Assert::AreEqual(offered[i].rank, copied[i].rank);
+      }
+    }
+
+    TEST_METHOD(TestRankMergeMatchesBruteForce)
+    {
+      auto points = acquire_test_points();
+      points[points.size() / 2].x = +1.0e30f;
+      // Past the outlier and down to a single spot.
+      std::vector<Rect> rects = test_rects();
+      rects.push_back({ -2.0e30f, -2.0e30f, +2.0e30f, +2.0e30f });
+      rects.push_back({ 0.0f, 0.0f, 0.0f, 0.0f });
+      for (std::size_t top_k_size : { 0ull, 32ull }) {
+        quad_tree::BuildOptions options;
+        options.top_k_size = top_k_size;
+        quad_tree tree(points.data(), points.data() + points.size(),
+          quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 10,
+          options);
+        tree.set_query_mode(quad_tree::QueryMode::RankMerge);
+        assert_rects_match_brute_force(tree, points, rects,
+          { 1, 10, 33, 100 });
+        assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+      }
+
+      SearchOptions search_options;
+      search_options.query_mode = quad_tree::QueryMode::RankMerge;
+      SearchContext* sc = create_with_options(points.data(),
+        points.data() + points.size(), &search_options);
+      Assert::IsTrue(quad_tree::QueryMode::RankMerge ==
+        sc->tree()->query_mode());
+      Assert::IsTrue(destroy(sc) == nullptr);
+    }
+
+    TEST_METHOD(TestSearchDoesNotAllocate)
+    {
+#ifdef _DEBUG
+      // The zero counts below only mean something if the hook sees
+      // allocations at all.
+      _CRT_ALLOC_HOOK previous = start_counting();
+      std::vector<char> probe(64u);
+      _CrtSetAllocHook(previous);
+      Assert::AreEqual(1, allocations);
+
+      auto points = acquire_test_points();
+      const std::vector<Rect> rects = test_rects();
+      std::vector<SearchOptions> configurations(9);
+      configurations[1].query_mode = quad_tree::QueryMode::BreadthFirst;
+      configurations[2].query_mode = quad_tree::QueryMode::RankMerge;
+      configurations[3].compact_nodes = true;
+      configurations[4].leaf_layout = quad_tree::LeafLayout::Soa;
+      configurations[5].engine = SearchEngine::LinearQuadTree;
+      configurations[6].engine = SearchEngine::PriorityKdTree;
+      configurations[7].engine = SearchEngine::RankScan;
+      configurations[8].engine = SearchEngine::Planned;
+
+      std::vector<Point> out_points(50);
+      for (const SearchOptions& options : configurations) {
+        SearchContext* sc = create_with_options(points.data(),
+          points.data() + points.size(), &options);
+        // The first round grows this thread's scratch, the second must
+        // reuse it.
+        for (int32_t round = 0; round < 2; ++round) {
+          previous = round == 0 ? nullptr : start_counting();
+          for (const Rect& rect : rects) {
+            for (int32_t count : { 10, 37, 50 }) {
+              search(sc, rect, count, out_points.data());
+            }
+          }
+          if (round != 0) {
+            _CrtSetAllocHook(previous);
+          }
+        }
+        Assert::AreEqual(0, allocations);
+        Assert::IsTrue(destroy(sc) == nullptr);
+      }
+#else
+      Logger::WriteMessage(
+        "TestSearchDoesNotAllocate skipped: it needs the debug heap.");
+#endif
+    }
+
+    TEST_METHOD(TestPrefetchDistanceDoesNotChangeResults)
+    {
+      auto points = acquire_test_points();
+      for (quad_tree::LeafLayout layout : { quad_tree::LeafLayout::Packed,
+        quad_tree::LeafLayout::Soa, quad_tree::LeafLayout::Quantized }) {
+        for (bool compact : { false, true }) {
+          quad_tree::BuildOptions options;
+          options.compact_nodes = compact;
+          options.leaf_layout = layout;
+          quad_tree tree(points.data(), points.data() + points.size(),
+            quad_tree::MIN_BLOCK_SIZE, quad_tree::MAX_BLOCK_SIZE / 10,
+            options);
+          Assert::AreEqual(std::size_t(quad_tree::PREFETCH_DISTANCE),
+            tree.prefetch_distance());
+          for (quad_tree::QueryMode mode : {
+            quad_tree::QueryMode::BreadthFirst,
+            quad_tree::QueryMode::BestFirst,
+            quad_tree::QueryMode::RankMerge }) {
+            tree.set_query_mode(mode);
+            // Past the end of every queue and heap the look ahead stops.
+            for (std::size_t distance : { 0ull, 1ull, 4ull, 100000ull }) {
+              tree.set_prefetch_distance(distance);
+              assert_query_matches_brute_force(tree, points, -16.0f, +16.0f);
+            }
+          }
+        }
+      }
+    }
+
+    TEST_METHOD(TestArenaAllocations)
+    {
+      arena pool(1024u);
+      Assert::AreEqual(std::size_t(0), pool.capacity_bytes());
+      for (std::size_t alignment : { 1ull, 8ull, 16ull, 64ull }) {
+        void* memory = pool.allocate(3u, alignment);
+        Assert::AreEqual(std::size_t(0),
+          reinterpret_cast<uintptr_t>(memory) % alignment);
+      }
+      Assert::AreEqual(std::size_t(1024), pool.capacity_bytes());
+
+      // Over a quarter of a block gets a block of its own, and the shared
+      // block keeps filling afterwards.
+      char* small = static_cast<char*>(pool.allocate(8u, 8u));
+      char* large = static_cast<char*>(pool.allocate(300u, 64u));
+      Assert::AreEqual(std::size_t(0),
+        reinterpret_cast<uintptr_t>(large) % 64u);
+      Assert::AreEqual(std::size_t(1324), pool.capacity_bytes());
+      Assert::IsTrue(static_cast<char*>(pool.allocate(8u, 8u)) ==
+        small + 8);
+
+      pool.release();
+      Assert::AreEqual(std::size_t(0), pool.capacity_bytes());
+      std::memset(pool.allocate(200u, 16u), 0xff, 200u);
+      Assert::AreEqual(std::size_t(1024), pool.capacity_bytes());
+
+      // Threads filling one arena never get overlapping memory.
+      pool.release();
+      const int32_t per_thread = 1000;
+      std::vector<std::vector<int32_t*>> handed_out(4);
+      std::vector<std::thread> threads;
+      for (std::size_t t = 0; t < handed_out.size(); ++t) {
+        threads.emplace_back([&, t]()
+        {
+          for (int32_t i = 0; i < per_thread; ++i) {
+            int32_t* value = static_cast<int32_t*>(
+              pool.allocate(sizeof(int32_t) * 3u, alignof(int32_t)));
+            std::fill(value, value + 3, static_cast<int32_t>(t) *
+              per_thread + i);
+            handed_out[t].push_back(value);
+          }
+        });
+      }
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+      for (std::size_t t = 0; t < handed_out.size(); ++t) {
+        for (int32_t i = 0; i < per_thread; ++i) {
+          const int32_t expected = static_cast<int32_t>(t) * per_thread + i;
+          for (int32_t j = 0; j < 3; ++j) {
+            Assert::AreEqual(expected, handed_out[t][i][j]);
+          }
+        }
+      }
+
+      // Without the lock a single thread is served the same way.
+      arena unlocked(1024u);
+      unlocked.set_thread_safe(false);
+      char* first = static_cast<char*>(unlocked.allocate(8u, 8u));
+      Assert::IsTrue(static_cast<char*>(unlocked.allocate(8u, 8u)) ==
+        first + 8);
+      Assert::AreEqual(std::size_t(1024), unlocked.capacity_bytes());
+    }
+
     TEST_METHOD(TestMinIdAtDepth)
     {
       uint64_t actual = 0ull;